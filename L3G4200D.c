@@ -18,7 +18,7 @@
 /*----------------------------------------------------------------------------*/
 /* Initialize gyroscope														  */
 /*----------------------------------------------------------------------------*/
-uint8_t init_gyro(uint8_t range_gyro, uint8_t bandwidth_gyro) {
+uint8_t init_gyro(uint8_t range_gyro, uint8_t bandwidth_gyro, uint8_t axes_gyro) {
 	uint8_t tmp8;
 
 /* Read WHO_AM_I (0x0F) (page 29)
@@ -30,9 +30,9 @@ uint8_t init_gyro(uint8_t range_gyro, uint8_t bandwidth_gyro) {
 	Output data rate: user defined (default: 100 Hz)
 	Cutoff: 70 Hz
 	Normal mode
-	All axes: Enabled
+	Axes enabled: user defined (bit 0: X, bit 1: Y, bit 2: Z)
 */
-	tmp8 = (bandwidth_gyro << 6) | 0x3F;
+	tmp8 = (bandwidth_gyro << 6) | 0x38 | (axes_gyro & 0x07);
 	write_addr_gyro(0x20, tmp8);
 
 /* Set CTRL_REG2 (21h) (page 30)
@@ -86,6 +86,25 @@ void power_down_gyro(void) {
 	write_addr_gyro(0x20, 0x00);
 }
 
+/*----------------------------------------------------------------------------*/
+/* Wake gyroscope from power down mode, keeping the registers set by an		  */
+/* earlier init_gyro() (the power was kept on). CTRL_REG4 is only written if  */
+/* the range changed. Return 0 if the gyroscope is not available.			  */
+/*----------------------------------------------------------------------------*/
+uint8_t wake_gyro(uint8_t range_gyro, uint8_t bandwidth_gyro, uint8_t prev_range_gyro, uint8_t axes_gyro) {
+	if (read_addr_gyro(0x0F) != 0xD3) return 0;
+
+	/* CTRL_REG1: leave power down mode with the data rate and axes */
+	write_addr_gyro(0x20, (bandwidth_gyro << 6) | 0x38 | (axes_gyro & 0x07));
+
+	/* CTRL_REG4: full scale */
+	if (range_gyro != prev_range_gyro) {
+		write_addr_gyro(0x23, range_gyro << 4);
+	}
+
+	return 1;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Read an address on gyroscope (send address, return response)				  */
 /*----------------------------------------------------------------------------*/
@@ -19,9 +19,10 @@
 #define DEFAULT_RANGE_GYRO			1	// Default range value (01: 500 dps)
 #define DEFAULT_BANDWIDTH_GYRO		0	// Default bandwidth value (00: 100 Hz)
 
-uint8_t init_gyro(uint8_t range_gyro, uint8_t bandwidth_gyro);
+uint8_t init_gyro(uint8_t range_gyro, uint8_t bandwidth_gyro, uint8_t axes_gyro);
 uint8_t gyro_not_avail(void);
 void power_down_gyro(void);
+uint8_t wake_gyro(uint8_t range_gyro, uint8_t bandwidth_gyro, uint8_t prev_range_gyro, uint8_t axes_gyro);
 uint8_t read_addr_gyro(uint8_t address);
 void write_addr_gyro(uint8_t address, uint8_t d);
 uint8_t gyro_int(void);
@@ -18,7 +18,7 @@
 /*----------------------------------------------------------------------------*/
 /* Initialize accelerometer													  */
 /*----------------------------------------------------------------------------*/
-uint8_t init_accel(uint8_t range_accel, uint8_t bandwidth_accel) {
+uint8_t init_accel(uint8_t range_accel, uint8_t bandwidth_accel, uint8_t axes_accel) {
 	uint8_t tmp8;
 	
 /* Read WHO_AM_I (0x0F) (page 30)
@@ -29,9 +29,9 @@ uint8_t init_accel(uint8_t range_accel, uint8_t bandwidth_accel) {
 /* Set CTRL_REG1 (20h) (page 31)
 	Normal mode
 	Data rate selection (default: 160 Hz)
-	All axes enabled
+	Axes enabled: user defined (bit 0: X, bit 1: Y, bit 2: Z)
 */
-	tmp8 = (bandwidth_accel << 4) | 0xC7;
+	tmp8 = (bandwidth_accel << 4) | 0xC0 | (axes_accel & 0x07);
 	write_addr_accel(0x20, tmp8);
 
 /* Set CTRL_REG2 (21h) (page 32) 0000 0100
@@ -67,6 +67,25 @@ void power_down_accel(void) {
 	write_addr_accel(0x20, 0x00);
 }
 
+/*----------------------------------------------------------------------------*/
+/* Wake accelerometer from power down mode, keeping the registers set by an	  */
+/* earlier init_accel() (the power was kept on). CTRL_REG2 is only written	  */
+/* if the range changed. Return 0 if the accelerometer is not available.	  */
+/*----------------------------------------------------------------------------*/
+uint8_t wake_accel(uint8_t range_accel, uint8_t bandwidth_accel, uint8_t prev_range_accel, uint8_t axes_accel) {
+	if (read_addr_accel(0x0F) != 0x3A) return 0;
+
+	/* CTRL_REG1: leave power down mode with the data rate and axes */
+	write_addr_accel(0x20, (bandwidth_accel << 4) | 0xC0 | (axes_accel & 0x07));
+
+	/* CTRL_REG2: full scale */
+	if (range_accel != prev_range_accel) {
+		write_addr_accel(0x21, (range_accel << 7) | 0x05);
+	}
+
+	return 1;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Read an address on accelerometer (send address, return response)			  */
 /*----------------------------------------------------------------------------*/
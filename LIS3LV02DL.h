@@ -19,9 +19,10 @@
 #define DEFAULT_RANGE_ACCEL			0	// Default range value (0: +/-2 g)
 #define DEFAULT_BANDWIDTH_ACCEL		0	// Default bandwidth value (00: 40 Hz)
 
-uint8_t init_accel(uint8_t range_accel, uint8_t bandwidth_accel);
+uint8_t init_accel(uint8_t range_accel, uint8_t bandwidth_accel, uint8_t axes_accel);
 uint8_t accel_not_avail(void);
 void power_down_accel(void);
+uint8_t wake_accel(uint8_t range_accel, uint8_t bandwidth_accel, uint8_t prev_range_accel, uint8_t axes_accel);
 uint8_t read_addr_accel(uint8_t address);
 void write_addr_accel(uint8_t address, uint8_t d);
 uint8_t accel_int(void);
@@ -0,0 +1,83 @@
+/**
+ * Written by Icewire Technologies
+ */
+
+#include "buttongesture.h"
+
+/* 
+ * Finish the gesture.
+ *
+ * Return the given button press
+ */
+enum ButtonPress end_button_gesture(struct ButtonGesture *button_gesture, enum ButtonPress button_press);
+
+void construct_button_gesture(struct ButtonGesture *button_gesture, uint16_t debounce_ticks, uint16_t hold_ticks, uint16_t window_ticks) {
+	button_gesture->state = GESTURE_IDLE;
+	button_gesture->ticks = 0;
+	button_gesture->taps = 0;
+	button_gesture->can_triple_tap = false;
+	button_gesture->debounce_ticks = debounce_ticks;
+	button_gesture->hold_ticks = hold_ticks;
+	button_gesture->window_ticks = window_ticks;
+}
+
+bool press_button_gesture(struct ButtonGesture *button_gesture, bool can_triple_tap) {
+	if (button_gesture->state != GESTURE_IDLE) {
+		return false;
+	}
+	button_gesture->state = GESTURE_DEBOUNCE;
+	button_gesture->ticks = 0;
+	button_gesture->taps = 0;
+	button_gesture->can_triple_tap = can_triple_tap;
+	return true;
+}
+
+void cancel_button_gesture(struct ButtonGesture *button_gesture) {
+	button_gesture->state = GESTURE_IDLE;
+}
+
+enum ButtonPress step_button_gesture(struct ButtonGesture *button_gesture, bool is_down) {
+	++button_gesture->ticks;
+	switch (button_gesture->state) {
+		case GESTURE_DEBOUNCE:
+			if (button_gesture->ticks >= button_gesture->debounce_ticks) {
+				button_gesture->state = GESTURE_PRESSED;
+				button_gesture->ticks = 0;
+			}
+			break;
+		case GESTURE_PRESSED:
+			if (is_down) {
+				/* Button held */
+				if (button_gesture->ticks >= button_gesture->hold_ticks) {
+					return end_button_gesture(button_gesture, BUTTON_HOLD);
+				}
+				break;
+			}
+			++button_gesture->taps;
+			if (!button_gesture->can_triple_tap) {
+				return end_button_gesture(button_gesture, BUTTON_TAP);
+			}
+			/* Triple tap achieved! */
+			if (button_gesture->taps == 3) {
+				return end_button_gesture(button_gesture, BUTTON_TRIPLE_TAP);
+			}
+			button_gesture->state = GESTURE_GAP;
+			button_gesture->ticks = 0;
+			break;
+		case GESTURE_GAP:
+			if (is_down) {
+				button_gesture->state = GESTURE_DEBOUNCE;
+				button_gesture->ticks = 0;
+			} else if (button_gesture->ticks >= button_gesture->window_ticks) {
+				/* Button was not pressed again within the time window */
+				return end_button_gesture(button_gesture, BUTTON_TAP);
+			}
+			break;
+	}
+	return BUTTON_NONE;
+}
+
+enum ButtonPress end_button_gesture(struct ButtonGesture *button_gesture, enum ButtonPress button_press) {
+	button_gesture->state = GESTURE_IDLE;
+	return button_press;
+}
@@ -0,0 +1,65 @@
+/**
+ * Written by Icewire Technologies
+ */
+
+#ifndef _BUTTONGESTURE_H
+#define _BUTTONGESTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "buttonbuffer.h"
+
+/* States of a button gesture */
+enum GestureState {
+	/* Waiting for the button to be pressed */
+	GESTURE_IDLE,
+	/* Button was just pressed; its level is ignored until it settles */
+	GESTURE_DEBOUNCE,
+	/* Button is held down */
+	GESTURE_PRESSED,
+	/* Button was tapped; waiting for the next tap of a triple tap */
+	GESTURE_GAP
+};
+
+/*
+ * Classifies a button press as a tap, hold or triple tap. The press is started
+ * from the button interrupt and then stepped by a periodic tick with the
+ * button's level, so nothing waits on the button.
+ */
+struct ButtonGesture {
+	uint8_t state;				/* enum GestureState */
+	uint16_t ticks;				/* Ticks spent in the current state */
+	uint8_t taps;				/* Taps so far */
+	bool can_triple_tap;
+	uint16_t debounce_ticks;	/* Ticks to ignore the level after a press */
+	uint16_t hold_ticks;		/* Ticks held down for a hold */
+	uint16_t window_ticks;		/* Ticks to wait for the next tap of a triple tap */
+};
+
+/* 
+ * Set up a button gesture with the given timing (in ticks).
+ */
+void construct_button_gesture(struct ButtonGesture *button_gesture, uint16_t debounce_ticks, uint16_t hold_ticks, uint16_t window_ticks);
+
+/* 
+ * Start a gesture on a button press.
+ *
+ * Return true if a new gesture was started, false if one is in progress
+ */
+bool press_button_gesture(struct ButtonGesture *button_gesture, bool can_triple_tap);
+
+/* 
+ * Abandon any gesture in progress.
+ */
+void cancel_button_gesture(struct ButtonGesture *button_gesture);
+
+/* 
+ * Advance the gesture by one tick.
+ *
+ * is_down: whether the button is held down
+ *
+ * Return the button press once the gesture is over, BUTTON_NONE until then
+ */
+enum ButtonPress step_button_gesture(struct ButtonGesture *button_gesture, bool is_down);
+
+#endif
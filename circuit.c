@@ -85,6 +85,13 @@ void activate_ctrl_interrupt(void) {
 	P1IES &= ~BIT1;
 }
 
+void deactivate_ctrl_interrupt(void) {
+	/* P1.1 interrupt disabled for CTRL button */
+	P1IE &= ~BIT1;
+	/* Clear pending CTRL button interrupt flag */
+	P1IFG &= ~BIT1;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Set interrupt flag for accelerometer (P1.5)								  */
 /*----------------------------------------------------------------------------*/
@@ -144,6 +151,25 @@ void mcu_spi_off(void) {
 	P1OUT &= (~BIT4) & (~BIT6);	// Accelerometer CS and gyroscope CS
 }
 
+/*----------------------------------------------------------------------------*/
+/* Turn off the MCU SPI outputs to the SD card only (so an unpowered card	  */
+/* isn't powered through them)												  */
+/*----------------------------------------------------------------------------*/
+void sd_spi_off(void) {
+	P4SEL &= ~(BIT0 | BIT4 | BIT5);				// Unselect USCI_A1 SPI function
+	P4OUT &= ~(BIT0 | BIT4 | BIT5 | BIT7);		// SD card SPI bus and CS set low
+	P4DIR |= BIT0 | BIT4 | BIT5 | BIT7;			// P4.0,4,5,7 output direction
+}
+
+/*----------------------------------------------------------------------------*/
+/* Turn the MCU SPI outputs to the SD card back on							  */
+/*----------------------------------------------------------------------------*/
+void sd_spi_on(void) {
+	P4OUT |= BIT7;								// SD card CS high
+	P4DIR &= ~BIT5;								// P4.5 input direction (UCA1SOMI)
+	P4SEL |= BIT0 | BIT4 | BIT5;				// P4.0,4,5 USCI_A1 SPI option select
+}
+
 /*----------------------------------------------------------------------------*/
 /* Turn LED light 1 on (P1.3)												  */
 /*----------------------------------------------------------------------------*/
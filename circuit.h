@@ -24,6 +24,7 @@ void deactivate_interrupts(void);
 void activate_accel_interrupt(void);
 void activate_gyro_interrupt(void);
 void activate_ctrl_interrupt(void);
+void deactivate_ctrl_interrupt(void);
 void set_int_accel(void);
 void clear_int_accel(void);
 void set_int_gyro(void);
@@ -32,6 +33,8 @@ void clear_int_ctrl(void);
 void power_on(uint8_t);
 void power_off(uint8_t);
 void mcu_spi_off(void);
+void sd_spi_off(void);
+void sd_spi_on(void);
 void led_1_on(void);
 void led_1_off(void);
 void led_1_toggle(void);
@@ -27,6 +27,9 @@ uint8_t num_key_value_settings;
 struct Setting *key_only_settings;
 uint8_t num_key_only_settings;
 
+/* Settings found while parsing */
+struct SettingValues *found_values;
+
 /* Boolean type */
 typedef enum { FALSE, TRUE } Bool;
 
@@ -100,8 +103,15 @@ Bool same(const uint8_t *const string, const struct substring *const substring);
  * data: The raw data
  *
  * block_offset: Offset of first block with file's data
+ *
+ * length: Size of the file in bytes
+ */
+void get_config_values(uint8_t *data, uint32_t block_offset, uint32_t length);
+
+/*
+ * Record a setting that was set in found_values
  */
-void get_config_values(uint8_t *data, uint32_t block_offset);
+void record_setting_value(enum SettingTable table, uint8_t index, uint16_t value);
 
 /* 
  * Parse key-value pair properties
@@ -171,50 +181,48 @@ void set_key_only_settings(struct Setting *_key_only_settings, uint8_t _num_key_
 	num_key_only_settings = _num_key_only_settings;
 }
 
-void get_user_config(uint8_t *data, struct fatstruct *info) {
-	uint32_t config_file_offset = 0; // Offset of first block with file's data
-	
-	/* Read first block of directory table */
-	read_block(data, info->dtoffset, SD_LONG_TIMEOUT);
-
-	/* Find config.ini file in directory table */
-	for (uint32_t i = 0; i < info->dtsize && config_file_offset == 0 && data[0] != 0x00; i += 512) {
-		read_block(data, info->dtoffset + i, SD_LONG_TIMEOUT);
-		for (uint32_t j = 0; j < 512; j += 32) {
-			/* Deleted file */
-			if (data[j] == 0xE5) continue;
-			/* End of directory table entries */
-			if (data[j] == 0x00) break;
-			/* Check for config.ini file */
-			if (data[j] == 'C'
-				&& data[j + 1] == 'O'
-				&& data[j + 2] == 'N'
-				&& data[j + 3] == 'F'
-				&& data[j + 4] == 'I'
-				&& data[j + 5] == 'G'
-				&& data[j + 6] == ' '
-				&& data[j + 7] == ' '
-				&& data[j + 8] == 'I'
-				&& data[j + 9] == 'N'
-				&& data[j + 10] == 'I') {
-				/* config.ini entry found. Store starting cluster */
-				config_file_offset = info->fileclustoffset + 
-										((((uint16_t)data[j + 27] << 8) +
-										(uint8_t)data[j + 26] - 2) *
-										info->nbytesinclust);
-				break;
-			}
+void get_user_config(uint8_t *data, struct fatstruct *info, const struct dirindex *index, struct SettingValues *found) {
+	found->count = 0;
+	found->overflow = FALSE;
+	found_values = found;
+	/* The config.ini entry was found while indexing the directory table */
+	if (index->config_entry != DIR_INDEX_NONE && index->config_cluster >= 2) {
+		/* Offset of first block with file's data */
+		uint32_t config_file_offset = get_cluster_offset(index->config_cluster, info);
+		/* Get values from config file and set variables */
+		get_config_values(data, config_file_offset, index->config_size);
+	}
+	found_values = 0;
+}
+
+void apply_setting_values(const struct SettingValues *found) {
+	for (uint8_t i = 0; i < found->count; ++i) {
+		const struct SettingValue *setting_value = &found->values[i];
+		if (setting_value->table == KEY_VALUE_SETTINGS &&
+			setting_value->index < num_key_value_settings) {
+			key_value_settings[setting_value->index].set_value(setting_value->value);
+		} else if (setting_value->table == KEY_ONLY_SETTINGS &&
+				   setting_value->index < num_key_only_settings) {
+			key_only_settings[setting_value->index].set_value(setting_value->value);
 		}
 	}
+}
 
-	/* If the config file was found */
-	if (config_file_offset > 0) {
-		/* Get values from config file and set variables */
-		get_config_values(data, config_file_offset);
+void record_setting_value(enum SettingTable table, uint8_t index, uint16_t value) {
+	if (found_values == 0) {
+		return;
 	}
+	if (found_values->count == MAX_SETTING_VALUES) {
+		found_values->overflow = TRUE;
+		return;
+	}
+	struct SettingValue *setting_value = &found_values->values[found_values->count++];
+	setting_value->table = table;
+	setting_value->index = index;
+	setting_value->value = value;
 }
 
-void get_config_values(uint8_t *data, uint32_t block_offset) {
+void get_config_values(uint8_t *data, uint32_t block_offset, uint32_t length) {
 	/* Current state in the Start the FSM in idle state */
 	enum State state = IDLE_STATE;
 
@@ -244,12 +252,18 @@ void get_config_values(uint8_t *data, uint32_t block_offset) {
 		if (i >= BLOCK_SIZE) {
 			/* Update the block offset */
 			block_offset += BLOCK_SIZE;
-			/* Read the next block into data[] */
-			read_block(data, block_offset, SD_LONG_TIMEOUT);
 			/* Reset the counter */
 			file_size += i;
 			i = 0;
+			/* Read the next block into data[] unless the file has ended */
+			if (file_size < length) {
+				read_block(data, block_offset, SD_LONG_TIMEOUT);
+			}
 		} else {
+			/* Bytes past the file's size are treated as the end of file */
+			if (file_size + i >= length) {
+				data[i] = EOF;
+			}
 
 			/* 
 			 * TODO create step function using the following as params:
@@ -418,7 +432,9 @@ void set_value_for_key_value_settings(struct substring *key, struct substring *v
 	for (uint8_t i = 0; i < num_key_value_settings; ++i) {
 		struct Setting *key_value_setting = &key_value_settings[i];
 		if (same(key_value_setting->key, key) == TRUE) {
-			key_value_setting->set_value(substring_to_uint16_t(value));
+			uint16_t setting = substring_to_uint16_t(value);
+			key_value_setting->set_value(setting);
+			record_setting_value(KEY_VALUE_SETTINGS, i, setting);
 		}
 	}
 }
@@ -428,6 +444,7 @@ void set_value_for_key_only_settings(struct substring *key) {
 		struct Setting *key_only_setting = &key_only_settings[i];
 		if (same(key_only_setting->key, key) == TRUE) {
 			key_only_setting->set_value(1);
+			record_setting_value(KEY_ONLY_SETTINGS, i, 1);
 		}
 	}
 }
@@ -14,6 +14,32 @@ struct Setting {
 	void (*set_value)(uint16_t);
 };
 
+/* Tables of settings */
+enum SettingTable {
+	KEY_VALUE_SETTINGS,
+	KEY_ONLY_SETTINGS
+};
+
+/* Most settings recorded from one config file */
+enum { MAX_SETTING_VALUES = 16 };
+
+/* A setting found in the config file and the value it was set to */
+struct SettingValue {
+	uint8_t table;		/* enum SettingTable */
+	uint8_t index;		/* Position in the table */
+	uint16_t value;
+};
+
+/*
+ * Settings found in the config file, in the order they were set, so they can be
+ * set again without parsing the file
+ */
+struct SettingValues {
+	uint8_t count;
+	uint8_t overflow;	/* More than MAX_SETTING_VALUES were found */
+	struct SettingValue values[MAX_SETTING_VALUES];
+};
+
 /*
  * Set an array of custom defined structs for key-value pair settings
  */
@@ -25,8 +51,16 @@ void set_key_value_settings(struct Setting *_key_value_settings, uint8_t _num_ke
 void set_key_only_settings(struct Setting *_key_only_settings, uint8_t _num_key_only_settings);
 
 /*
- * Find and parse config.ini file and set configuration values (range, bandwidth)
+ * Parse the config.ini file found in the directory table index and set
+ * configuration values (range, bandwidth). The settings found are recorded in
+ * found.
+ */
+void get_user_config(uint8_t *data, struct fatstruct *info, const struct dirindex *index, struct SettingValues *found);
+
+/*
+ * Set the settings recorded by get_user_config() again using the current
+ * tables
  */
-void get_user_config(uint8_t *data, struct fatstruct *info);
+void apply_setting_values(const struct SettingValues *found);
 
 #endif
\ No newline at end of file
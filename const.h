@@ -18,21 +18,96 @@ enum { LOG_FLASH_RATE = 1 };
 /* Amount of time between LED flashes in seconds when waiting for format action */
 enum { FORMAT_FLASH_RATE = 1 };
 
-/* Size of raw data buffers */
+/* Time (in ms) the LED is on for a weak, strong and long flash */
+enum { LED_WEAK_FLASH_MS = 5 };
+enum { LED_STRONG_FLASH_MS = 50 };
+enum { LED_LONG_FLASH_MS = 300 };
+
+/* Time (in ms) the LED is off between the flashes of a triple tap and of the format signal */
+enum { LED_TRIPLE_FLASH_GAP_MS = 50 };
+enum { LED_FORMAT_FLASH_GAP_MS = 150 };
+
+/* Time (in ms) the LED is on or off while panicking */
+enum { LED_PANIC_MS = 40 };
+
+/* Time (in ms) the LED is on and off while signalling low voltage */
+enum { LED_LOW_VOLTAGE_ON_MS = 1 };
+enum { LED_LOW_VOLTAGE_OFF_MS = 55 };
+
+/* Number of flashes for the panic and low voltage signals */
+enum { LED_SIGNAL_FLASHES = 10 };
+
+/* Steps of LED patterns waiting to be played */
+enum { LED_STEP_BUFF_SIZE = 24 };
+
+/* Battery level filter: each reading moves the level 1/2^BATTERY_FILTER_SHIFT of the way */
+enum { BATTERY_FILTER_SHIFT = 2 };
+
+/* Fraction bits kept in the filtered battery level */
+enum { BATTERY_LEVEL_FRAC_BITS = 4 };
+
+/* Bytes of a raw sample record: dt[3] then (x,y,z)[2] of each logger in use */
+enum { SAMPLE_DT_SIZE = 3 };
+enum { SAMPLE_AXES_SIZE = 6 };
+enum { SAMPLE_RECORD_MAX = SAMPLE_DT_SIZE + 2 * SAMPLE_AXES_SIZE };
+
+/* Axes of a logger (bit 0: x, bit 1: y, bit 2: z) */
+enum { AXES_ALL = 0x07 };
+
+/* Axes of both loggers (bits 0-2: accelerometer, bits 3-5: gyroscope) */
+enum { CHANNELS_ALL = 0x3F };
+
+/* Size of raw data buffers in records of SAMPLE_RECORD_MAX bytes */
 //enum { RAW_SAMPLE_BUFF_SIZE = 250 };
-enum { RAW_SAMPLE_BUFF_SIZE = 217 };
-//enum { RAW_SAMPLE_BUFF_SIZE = 149 };
+//enum { RAW_SAMPLE_BUFF_SIZE = 217 };
+enum { RAW_SAMPLE_BUFF_SIZE = 149 };
 
 /* Should be a multiple of SD card write block (512B) */
 //enum { SD_SAMPLE_BUFF_SIZE = 512 };
 enum { SD_SAMPLE_BUFF_SIZE = 1024 };
 //enum { SD_SAMPLE_BUFF_SIZE = 2048 };
 
+/* Multiple block writes timed for each write size when logging starts */
+enum { SD_PROBE_WRITES = 8 };
+
+/* Write sizes probed: 1 block up to the whole SD card buffer */
+enum { SD_PROBE_SIZES = SD_SAMPLE_BUFF_SIZE / 512 };
+
+/* Sample rate (Hz) at which the SD card can be powered off between batches */
+enum { SD_GATE_SAMPLE_RATE = 40 };
+
+/* Raw samples gathered while the SD card is powered off (the rest cover waking it) */
+enum { SD_GATE_BATCH_SAMPLES = RAW_SAMPLE_BUFF_SIZE * 3 / 4 };
+
+/* Marks a valid config cache; change it whenever the cache or the settings tables change */
+enum { CONFIG_CACHE_KEY = 0xCA05 };
+
+/* Minutes the SD card and sensors stay powered after logging stops, for a quick restart */
+enum { WARM_START_MINUTES = 1 };
+
+/* Raw samples buffered before the main loop is woken to process them */
+enum { SAMPLE_WATERMARK = RAW_SAMPLE_BUFF_SIZE / 4 };
+
+/* Most times the sample rate is halved while the raw samples buffer backs up */
+enum { DECIMATION_MAX_LEVEL = 3 };
+
+/* Most raw samples processed in one pass of the main loop */
+enum { LOG_SLICE_SAMPLES = 16 };
+
+/* Default seconds of samples between checkpoints of the open file */
+enum { DEFAULT_CHECKPOINT_SECONDS = 10 };
+
+/* Default clusters between checkpoints of the open file */
+enum { DEFAULT_CHECKPOINT_CLUSTERS = 1 };
+
 /* 1B */
 enum { BUTTON_BUFF_SIZE = 1 };
 
-/* Time (in cycles) to wait for button debouncing */
-enum { BUTTON_DEBOUNCE_TIME = 0x1000 };
+/* Time (in ms) between checks of the button during a press */
+enum { BUTTON_TICK_MS = 10 };
+
+/* Time (in ms) to wait for button debouncing */
+enum { BUTTON_DEBOUNCE_MS = 10 };
 
 /* Time (in seconds) to detect a held button press */
 enum { BUTTON_HOLD_TIME = 2 };
@@ -0,0 +1,94 @@
+/**
+ * Written by Icewire Technologies
+ */
+
+#include "decimator.h"
+
+/*
+ * Choose the level for the next record from the records buffered.
+ */
+void set_decimation_level(struct Decimator *decimator, uint16_t buffered);
+
+void construct_decimator(struct Decimator *decimator, uint8_t axes, uint16_t sample_rate, uint16_t high_watermark, uint16_t capacity, uint8_t max_level) {
+	decimator->level = 0;
+	decimator->max_level = max_level;
+	decimator->has_marker = false;
+	decimator->count = 0;
+	decimator->axes = (axes > DECIMATOR_MAX_AXES) ? DECIMATOR_MAX_AXES : axes;
+	decimator->sample_rate = sample_rate;
+	decimator->high_watermark = high_watermark;
+	decimator->low_watermark = high_watermark / 2;
+	decimator->capacity = capacity;
+	for (uint8_t k = 0; k < DECIMATOR_MAX_AXES; ++k) {
+		decimator->sums[k] = 0;
+	}
+}
+
+void set_decimation_level(struct Decimator *decimator, uint16_t buffered) {
+	if (decimator->high_watermark == 0 || decimator->high_watermark >= decimator->capacity) {
+		return;
+	}
+	/* Each level up takes half of the room left above the last */
+	uint16_t room = decimator->capacity - decimator->high_watermark;
+	uint8_t level = decimator->level;
+	while (level < decimator->max_level && buffered >= decimator->capacity - (room >> level)) {
+		++level;
+	}
+	/* Come down one level at a time once the buffer has drained */
+	if (level == decimator->level && level > 0 && buffered <= decimator->low_watermark) {
+		--level;
+	}
+	if (level != decimator->level) {
+		decimator->level = level;
+		decimator->has_marker = true;
+	}
+}
+
+uint8_t decimate_sample(struct Decimator *decimator, uint16_t buffered, uint8_t *record) {
+	if (decimator->count == 0) {
+		set_decimation_level(decimator, buffered);
+	}
+	if (decimator->level == 0) {
+		return 1;
+	}
+	for (uint8_t k = 0; k < decimator->axes; ++k) {
+		uint8_t *axis = &record[3 + 2 * k];
+		decimator->sums[k] += (int16_t)(((uint16_t)axis[0] << 8) | axis[1]);
+	}
+	uint8_t samples = 1 << decimator->level;
+	if (++decimator->count < samples) {
+		return 0;
+	}
+	/* The average replaces the last sample's axes */
+	for (uint8_t k = 0; k < decimator->axes; ++k) {
+		int16_t average = decimator->sums[k] >> decimator->level;
+		record[3 + 2 * k] = (uint16_t)average >> 8;
+		record[3 + 2 * k + 1] = average;
+		decimator->sums[k] = 0;
+	}
+	decimator->count = 0;
+	return samples;
+}
+
+bool rate_marker(const struct Decimator *decimator, uint8_t *record) {
+	if (!decimator->has_marker) {
+		return false;
+	}
+	record[0] = (uint8_t)(RATE_MARKER_DT >> 16);
+	record[1] = (uint8_t)(RATE_MARKER_DT >> 8);
+	record[2] = (uint8_t)RATE_MARKER_DT;
+	uint16_t values[2] = {
+		decimator->sample_rate >> decimator->level,
+		1 << decimator->level
+	};
+	for (uint8_t k = 0; k < decimator->axes; ++k) {
+		uint16_t value = (k < 2) ? values[k] : 0;
+		record[3 + 2 * k] = value >> 8;
+		record[3 + 2 * k + 1] = value;
+	}
+	return true;
+}
+
+void rate_marker_added(struct Decimator *decimator) {
+	decimator->has_marker = false;
+}
@@ -0,0 +1,74 @@
+/**
+ * Written by Icewire Technologies
+ */
+
+#ifndef _DECIMATOR_H
+#define _DECIMATOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Most axes in a sample record */
+enum { DECIMATOR_MAX_AXES = 6 };
+
+/* Delta time of a rate change marker record (never a real delta time) */
+#define RATE_MARKER_DT		0xFFFFFFUL
+
+/*
+ * Lowers the rate of the sample records put in a raw samples buffer while the
+ * buffer backs up, instead of letting samples be dropped when it is full. Each
+ * level halves the rate by averaging twice as many samples into one record,
+ * and the level is chosen from the number of records buffered when a record
+ * is started. A marker record comes before the first record at each new rate.
+ *
+ * A sample record is dt[3] then each axis[2], big-endian.
+ */
+struct Decimator {
+	uint8_t level;				/* 2^level samples are averaged into a record */
+	uint8_t max_level;
+	bool has_marker;			/* A rate change marker is waiting to be buffered */
+	uint8_t count;				/* Samples summed for the record being averaged */
+	uint8_t axes;				/* Axes in a sample record */
+	uint16_t sample_rate;		/* Sample rate (Hz) at level 0 */
+	uint16_t high_watermark;	/* Buffered records at which the rate is first halved (0: disabled) */
+	uint16_t low_watermark;		/* Buffered records at which the rate is doubled again */
+	uint16_t capacity;			/* Records the buffer can hold */
+	int32_t sums[DECIMATOR_MAX_AXES];
+};
+
+/*
+ * Set up a decimator at the full sample rate.
+ *
+ * axes: axes in a sample record
+ * sample_rate: full sample rate (Hz), only used for the marker records
+ * high_watermark: buffered records at which the rate is first halved (0 disables decimation)
+ * capacity: records the buffer can hold
+ */
+void construct_decimator(struct Decimator *decimator, uint8_t axes, uint16_t sample_rate, uint16_t high_watermark, uint16_t capacity, uint8_t max_level);
+
+/*
+ * Add a sample record to the record being averaged.
+ *
+ * buffered: records in the buffer
+ *
+ * Return the number of samples averaged into record when it is ready to be
+ * buffered (its delta time is the sample's), or 0 while more samples are needed
+ */
+uint8_t decimate_sample(struct Decimator *decimator, uint16_t buffered, uint8_t *record);
+
+/*
+ * Put the rate change marker in record: dt is RATE_MARKER_DT, the first axis
+ * is the new sample rate (Hz) and the second axis is the number of samples
+ * averaged into each record. A record with fewer axes only has the values
+ * it has room for.
+ *
+ * Return true if a marker is waiting to be buffered
+ */
+bool rate_marker(const struct Decimator *decimator, uint8_t *record);
+
+/*
+ * The marker from rate_marker() was buffered.
+ */
+void rate_marker_added(struct Decimator *decimator);
+
+#endif
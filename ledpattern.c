@@ -0,0 +1,49 @@
+/**
+ * Written by Icewire Technologies
+ */
+
+#include "ledpattern.h"
+
+void construct_led_pattern(struct LedPattern *led_pattern, volatile struct LedStep *steps, uint16_t size) {
+	led_pattern->steps = steps;
+	led_pattern->size = size;
+	led_pattern->start = 0;
+	led_pattern->end = 0;
+	led_pattern->count = 0;
+}
+
+void clear_led_pattern(struct LedPattern *led_pattern) {
+	led_pattern->start = 0;
+	led_pattern->end = 0;
+	led_pattern->count = 0;
+}
+
+bool add_led_step(struct LedPattern *led_pattern, bool is_on, uint16_t duration) {
+	/* The buffer is full */
+	if (led_pattern->count == led_pattern->size) {
+		return false;
+	}
+	/* Set data for new step based on parameters */
+	volatile struct LedStep *step = &led_pattern->steps[led_pattern->end];
+	step->is_on = is_on;
+	step->duration = duration;
+	/* Increment the index for the next step */
+	led_pattern->end = (led_pattern->end + 1) % led_pattern->size;
+	++led_pattern->count;
+	return true;
+}
+
+bool remove_led_step(struct LedPattern *led_pattern, struct LedStep *step_ret) {
+	/* The buffer is empty */
+	if (led_pattern->count == 0) {
+		return false;
+	}
+	/* Get the oldest step */
+	volatile struct LedStep *step = &led_pattern->steps[led_pattern->start];
+	step_ret->is_on = step->is_on;
+	step_ret->duration = step->duration;
+	/* Increment the index for the next step */
+	led_pattern->start = (led_pattern->start + 1) % led_pattern->size;
+	--led_pattern->count;
+	return true;
+}
@@ -0,0 +1,57 @@
+/**
+ * Written by Icewire Technologies
+ */
+
+#ifndef _LEDPATTERN_H
+#define _LEDPATTERN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* One step of an LED pattern */
+struct LedStep {
+	bool is_on;
+	/* How long the LED stays in this state, in timer ticks */
+	uint16_t duration;
+};
+
+/* Circular buffer of LED steps, played in order by a timer interrupt */
+struct LedPattern {
+	volatile struct LedStep *steps;
+	uint16_t size;
+	uint16_t start;
+	uint16_t end;
+	volatile uint16_t count;
+};
+
+/* 
+ * Set up a new LED pattern using the provided steps.
+ * 
+ * led_pattern: the buffer for holding the specified steps.
+ *
+ * steps: the steps the buffer holds.
+ *
+ * size: the number of steps.
+ */
+void construct_led_pattern(struct LedPattern *led_pattern, volatile struct LedStep *steps, uint16_t size);
+
+/* 
+ * Drop all the steps that haven't been played.
+ */
+void clear_led_pattern(struct LedPattern *led_pattern);
+
+/* 
+ * Insert a new step at the end of the pattern.
+ *
+ * Return true if the insertion was successful, false if the buffer is full
+ */
+bool add_led_step(struct LedPattern *led_pattern, bool is_on, uint16_t duration);
+
+/* 
+ * Retrieve and remove the next step to play.
+ *
+ * Return true if the retrieval was successful, false if the pattern is over
+ */
+bool remove_led_step(struct LedPattern *led_pattern, struct LedStep *step_ret);
+
+#endif
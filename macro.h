@@ -15,6 +15,9 @@
 /* Uncomment for easier debugging */
 //#define DEBUG
 
+/* Uncomment to time the SD card paths and report the results in the file header */
+//#define BENCHMARK
+
 /* Update for new firmware versions */
 #define FIRMWARE_NAME			"AG-1"
 #define FIRMWARE_VERSION		"20140110"
@@ -22,23 +25,35 @@
 /* Name of log files (max. 5 chars) */
 #define FILE_NAME	"DATA"
 
-/* DCO speed (MHz) */
+/* Name of gyroscope stream log files (max. 5 chars) */
+#define GYRO_FILE_NAME	"GYRO"
+
+/* Name of files recovered from a session that was cut off (max. 5 chars) */
+#define RECOVERED_FILE_NAME	"REC"
+
+/* SMCLK speed (MHz), which doesn't change (MCLK may be doubled, see clock_fast) */
 #define CLOCK_SPEED	12
 
+/* Timer_A ticks per second (timer is sourced from SMCLK) */
+#define TIMER_TICKS_PER_SECOND	(CLOCK_SPEED * 1000000UL)
+
+/* Timer_A ticks before an SD card write is stopped and sent again (must stay under 2^24) */
+#define SD_WRITE_TIMEOUT	(TIMER_TICKS_PER_SECOND / 2)
+
+/* Timer_A ticks between polls of an SD card that is busy writing (0.5 ms) */
+#define SD_POLL_TICKS	(TIMER_TICKS_PER_SECOND / 2000)
+
 /* Infinite loop */
 #define HANG()	for (;;);
 
-/* Small delay before powering on components */
-#define POWER_ON_DELAY() \
-	for (uint8_t j = 0; j < CLOCK_SPEED; j++) { \
-		for (uint16_t i = 0; i < 5000; i++) __no_operation(); \
-	}
-
-/* Delay between multiple LED flashes */
-#define LED_FLASH_DELAY(DELAY) \
-	for (uint8_t j = 0; j < CLOCK_SPEED; ++j) { \
-		for (uint16_t i = 0; i < DELAY; ++i) __no_operation(); \
-	}
+/* Timer_A ticks to wait for a regulator to finish powering on (25 ms) */
+#define POWER_ON_TICKS	(TIMER_TICKS_PER_SECOND / 40)
+
+/* ACLK (LED pattern timer) in Hz */
+#define ACLK_SPEED	32768UL
+
+/* LED pattern timer ticks in MS milliseconds */
+#define LED_TICKS(MS)	((uint16_t)(ACLK_SPEED * (MS) / 1000))
 
 
 #endif
@@ -11,15 +11,53 @@
  *     A line that matches /^ *gr *= *[0-9]+ *$/ is used to set the range of the
  *         gyroscope. Valid range values: 250, 500, 2000.
  *     A line that matches /^ *gs *= *[0-9]+ *$/ is used to set the sample rate of
- *         the gyroscope. Valid bandwidth values: 100, 200, 400, 800.
+ *         the gyroscope and log it on its own data ready interrupt to GYROnnn.CSV
+ *         (with its own dt column) next to the accelerometer's DATAnnn.CSV.
+ *         Valid bandwidth values: 100, 200, 400, 800 (0 keeps the gyroscope in
+ *         the accelerometer's samples). Not used with burst_sec or sync_sample.
  *     A line that matches /^ *disable_gyro *$/ is used to disable logging for the
  *         gyroscope.
  *     A line that matches /^ *disable_accel *$/ is used to disable logging for the
  *         accelerometer.
+ *     A line that matches /^ *cp_sec *= *[0-9]+ *$/ is used to set the number of
+ *         seconds between checkpoints of the open file (0 disables).
+ *     A line that matches /^ *cp_clust *= *[0-9]+ *$/ is used to set the number of
+ *         clusters between checkpoints of the open file (0 disables).
+ *     A line that matches /^ *rot_mb *= *[0-9]+ *$/ is used to start a new file
+ *         once the open file reaches the given size in MB (0 disables).
+ *     A line that matches /^ *rot_min *= *[0-9]+ *$/ is used to start a new file
+ *         once the open file holds the given minutes of samples (0 disables).
+ *     A line that matches /^ *disable_recovery *$/ is used to skip the search for
+ *         orphaned clusters (left by a session that was cut off) when logging
+ *         starts.
+ *     A line that matches /^ *ring_log *$/ is used to keep logging when the SD
+ *         card is full by deleting the oldest log files (or, if the open file is
+ *         the only one left, its oldest clusters).
+ *     A line that matches /^ *sd_gate *$/ is used to power the SD card off
+ *         between batches of samples when the sample rate is 40 Hz.
+ *     A line that matches /^ *burst_sec *= *[0-9]+ *$/ is used to capture the
+ *         given seconds of raw samples to a .BIN file in a run of clusters
+ *         reserved when logging starts, with no FAT or directory table updates
+ *         until the capture ends (0 disables).
+ *     A line that matches /^ *channels *= *[0-9]+ *$/ is used to choose the axes
+ *         that are read and logged, as the sum of: 1 (accel x), 2 (accel y),
+ *         4 (accel z), 8 (gyro x), 16 (gyro y), 32 (gyro z). A logger with none
+ *         of its axes chosen is disabled. Default: 63 (all axes).
+ *     A line that matches /^ *decimate_pct *= *[0-9]+ *$/ is used to halve the
+ *         sample rate (up to 3 times, averaging the samples) while more than the
+ *         given percent of the raw samples buffer waits for the SD card, instead
+ *         of dropping samples when it is full (0 disables). Each change of rate
+ *         is marked by a line with a dt of 16777215, the new sample rate and the
+ *         number of samples averaged per line (as many of the two as the line
+ *         has axes for).
+ *     A line that matches /^ *sync_sample *$/ is used to take samples of both
+ *         sensors together on a timer tick locked to the crystal instead of on
+ *         the accelerometer's interrupt.
  */
 
 #include <msp430f5310.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include "spi.h"
 #include "sdfat.h"
@@ -29,7 +67,10 @@
 #include "msp430f5310_extra.h"
 #include "circuit.h"
 #include "samplebuffer.h"
+#include "ledpattern.h"
 #include "buttonbuffer.h"
+#include "buttongesture.h"
+#include "decimator.h"
 #include "const.h"
 #include "macro.h"
 #include "conversions.h"
@@ -50,26 +91,161 @@ enum DeviceState {
 	FORMAT_STATE
 };
 
+/* Events posted by interrupts to wake the main loop */
+enum Event {
+	/* The raw sample buffer reached SAMPLE_WATERMARK */
+	EVENT_SAMPLES = 0x01,
+	/* The SD card write in progress needs another step */
+	EVENT_SD_POLL = 0x02,
+	/* A button press was added to the buffer */
+	EVENT_BUTTON = 0x04,
+	/* The RTC ticked (twice per second) */
+	EVENT_TICK = 0x08
+};
+
 /* Data logger settings */
 struct Logger {
 	bool is_enabled;
 	uint8_t range;
 	uint8_t bandwidth;
+	/* Axes in use (bit 0: x, bit 1: y, bit 2: z) */
+	uint8_t axes;
 };
 
 /* Buffer of data to write to SD card */
 struct SdCardFile {
-	uint8_t buffer[SD_SAMPLE_BUFF_SIZE];
-	/* Current index in buffer */
-	uint16_t index;
-	/* First cluster index */
-	uint16_t start_cluster;
-	/* Current cluster index */
-	uint32_t cluster;
-	/* Number of blocks */
-	uint8_t block_num;
-	/* Total bytes */
-	uint32_t size;
+	uint8_t *buffer;
+	/* File handle writing through buffer */
+	struct sdfile file;
+	/* Seconds of samples since the last checkpoint */
+	uint16_t checkpoint_seconds;
+	/* Timer ticks of samples toward the next second */
+	uint32_t ticks;
+	/* Seconds of samples in the file */
+	uint32_t seconds;
+};
+
+/* When to commit the open file's size to its directory table entry */
+struct Checkpoint {
+	/* Seconds between checkpoints (0: disabled) */
+	uint16_t seconds;
+	/* Clusters between checkpoints (0: disabled) */
+	uint16_t clusters;
+};
+
+/*
+ * Power gating of the SD card between batches of samples
+ *
+ * At 40 Hz the samples take about 1.6 KB/s of CSV, so an always-on card spends
+ * nearly all of its time idle. With gating the raw samples buffer is the batch:
+ * the card is powered off until SD_GATE_BATCH_SAMPLES samples (about 2.8 s)
+ * have built up, then powered on, initialized and given the batch as CSV, and
+ * powered off again once its full blocks are written.
+ *
+ * Energy per MB logged at 40 Hz (1 MB takes about 640 s), with typical card
+ * figures at 3.3 V: 1.5 mA idle, 30 mA while writing, 15 mA for about 100 ms
+ * to power up and initialize, and about 5 s of writing per MB:
+ *     always on: 640 s * 1.5 mA + 5 s * 30 mA = 1110 mAs (0.31 mAh)
+ *     gated: 230 batches * 100 ms * 15 mA + 5 s * 30 mA = 495 mAs (0.14 mAh)
+ * Gating pays while the idle charge between batches (2.8 s * 1.5 mA = 4.2 mAs)
+ * is more than the charge to wake the card (1.5 mAs). At 160 Hz a batch only
+ * lasts 0.7 s, so the card is left on.
+ */
+struct SdGate {
+	/* Whether the card is powered off between batches */
+	bool is_active;
+	/* Whether the card is powered */
+	bool card_is_on;
+	/* Number of times the card was powered on for a batch */
+	uint32_t wakes;
+};
+
+/* Capture of raw samples to a reserved run of clusters */
+struct Burst {
+	/* Seconds of samples to capture (0: disabled) */
+	uint16_t seconds;
+};
+
+/* SD card write speed, measured when logging starts */
+struct CardProbe {
+	/* Whether the results are for the card in use */
+	bool is_valid;
+	/* Mean and worst timer ticks of a write of k+1 blocks */
+	uint32_t mean_ticks[SD_PROBE_SIZES];
+	uint32_t worst_ticks[SD_PROBE_SIZES];
+	/* Full blocks gathered before each write */
+	uint8_t batch;
+	/* Highest sample rate the card keeps up with (0: none) */
+	uint16_t max_sample_rate;
+};
+
+/* Settings and FAT geometry from the last parse of a config file */
+struct ConfigCache {
+	/* CONFIG_CACHE_KEY when the rest is valid (erased flash reads 0xFFFF) */
+	uint16_t key;
+	/* Directory table index with the CONFIG.INI entry that was parsed */
+	struct dirindex dir;
+	/* Fields of fatinfo parsed from the boot sector */
+	uint8_t geometry[FAT_GEOMETRY_SIZE];
+	/* Settings found in CONFIG.INI */
+	struct SettingValues settings;
+};
+
+/*
+ * Devices left powered after logging stops. Logging that starts again soon
+ * after only checks that they are still ready and writes the settings that
+ * changed, instead of initializing them from power-on.
+ */
+struct WarmStart {
+	/* Whether the regulators were left on */
+	bool is_powered;
+	/* Whether the gyroscope's regulator was left on */
+	bool gyro_is_on;
+	/* Ranges the sensors were last set to */
+	uint8_t range_accel;
+	uint8_t range_gyro;
+};
+
+/*
+ * Sampling on a Timer2_A tick at the sample rate instead of the accelerometer's
+ * data ready interrupt. Both sensors run faster than the tick, so each tick
+ * reads values less than one of their output periods old. The tick comes from
+ * SMCLK, whose FLL is locked to the crystal when it starts.
+ */
+struct SyncSampling {
+	/* Whether the config asks for it */
+	bool is_enabled;
+	/* Whether the current session samples on the tick */
+	bool is_active;
+	/* Timer_A ticks between samples */
+	uint32_t period;
+	/* Fewest and most timer ticks between consecutive samples */
+	uint32_t min_ticks;
+	uint32_t max_ticks;
+	/* Whether a sample was taken since sampling started */
+	bool has_sample;
+};
+
+/*
+ * Gyroscope samples taken on its own data ready interrupt at its own rate and
+ * logged to GYROnnn.CSV, numbered like the DATAnnn.CSV logged alongside. The
+ * raw samples buffer and the SD card buffer are split between the two files.
+ */
+struct GyroStream {
+	/* Sample rate (Hz) from the config (0: gyroscope samples go with the accelerometer's) */
+	uint16_t sample_rate;
+	/* Whether the current session logs the gyroscope to its own file */
+	bool is_active;
+	/* Raw samples buffered before the sample event is posted */
+	uint16_t watermark;
+};
+
+/* When to close the open file and continue logging in a new one */
+struct Rotation {
+	/* File size in MB (0: disabled) */
+	uint16_t megabytes;
+	/* Minutes of samples (0: disabled) */
+	uint16_t minutes;
 };
 
 /*
@@ -84,9 +260,41 @@ void power_on_accelerometer(void);
 void power_off_accelerometer(void);
 void power_on_gyroscope(void);
 void power_off_gyroscope(void);
+/* Leave the SD card and sensors powered (sensors in power down mode) for a warm start */
+void keep_devices_warm(void);
+/* Power off devices left on by keep_devices_warm() */
+void power_off_warm_devices(void);
+/* Wake the sensors kept warm, falling back to a full initialization */
+void wake_accelerometer(void);
+void wake_gyroscope(void);
+/* Initialize a powered SD card, accelerometer or gyroscope */
+void init_sd_card(void);
+/* Run the CPU and SD card SPI fast for logging and formatting */
+void clock_fast(void);
+/* Run the CPU and SD card SPI at their normal speed */
+void clock_normal(void);
+void init_accelerometer(void);
+/* Bandwidth bits the accelerometer runs at (faster than the sample rate for sync sampling) */
+uint8_t accel_output_bandwidth(void);
+/* Start sampling on the Timer2_A tick */
+void start_sync_sampling(void);
+/* Add the timer ticks between two samples to the sync sampling statistics */
+void record_sync_ticks(uint32_t ticks);
+/* Add a line with the sync sampling period and spacing */
+void add_sync_stats_to_sd_card_file(struct SdCardFile *const sd_card_file);
+/* Take a sample and post the samples event once there are enough */
+void sample_event(void);
+void init_gyroscope(void);
+/* Sleep in LPM0 for the given Timer_A ticks */
+void timer_delay(uint32_t ticks);
 void enable_button_pressing(bool enable_button_tap_flash, bool enable_triple_tap);
 /* Note: perform an empty read before so we can clear P1.5 */
 void accelerometer_empty_read(void);
+/* Read the battery voltage now and restart the filtered battery level from it */
+void measure_battery(void);
+/* Add an ADC reading to the filtered battery level */
+void filter_battery_level(uint16_t voltage);
+/* Show low voltage iff the filtered battery level is low */
 bool voltage_is_low(void);
 /* Flash LED multiple times quickly to show "panic" */
 void led_1_panic(void);
@@ -100,6 +308,24 @@ void led_1_weak_flash(void);
 void led_1_strong_flash(void);
 /* Flash LED for a longer amount of time */
 void led_1_long_flash(void);
+/* Flash LED strongly three times (triple tap) */
+void led_1_triple_flash(void);
+/* Flash LED weakly twice (waiting for format action) */
+void led_1_format_flash(void);
+/* Stop any LED pattern and leave the LED on */
+void led_1_hold_on(void);
+/*
+ * LED patterns are queued as steps and played by the Timer1_A interrupt, so
+ * showing one never blocks. A pattern ends with the LED off.
+ */
+/* Queue an LED step, starting the pattern if none is playing */
+void queue_led_step(bool is_on, uint16_t ms);
+/* Show the next LED step; return false when the pattern is over */
+bool next_led_step(void);
+/* Drop the LED pattern being played */
+void stop_led_pattern(void);
+/* Sleep until the LED pattern is over */
+void wait_for_led(void);
 
 void init(void);
 void restart(void);
@@ -113,36 +339,129 @@ enum DeviceState idle_step(void);
 enum DeviceState log_step(void);
 enum DeviceState format_step(void);
 void init_sd_fat(void);
+/* Save the settings found in the config file and the FAT geometry to the config cache */
+void save_config_cache(const struct SettingValues *found);
+/* Mark the config cache invalid */
+void clear_config_cache(void);
+/* Time writes to the new file's first cluster and choose how the file is written */
+void probe_sd_card(struct SdCardFile *const sd_card_file);
+/* Whether the probed card keeps up with sample_rate writing batch blocks at a time */
+bool card_keeps_up(uint8_t batch, uint16_t sample_rate);
+/* Longest line a sample can take in the file */
+uint8_t max_sample_line_length(void);
+/* Add a line with the SD card write probe results */
+void add_card_probe_to_sd_card_file(struct SdCardFile *const sd_card_file);
+void recover_sd_card_files(void);
 void format_sd_card(void);
 void new_sd_card_file(struct SdCardFile *const sd_card_file);
+/* Claim the file's first cluster and entry (probing the card if needed) */
+void open_sd_card_file(struct SdCardFile *const sd_card_file);
+/* Put the file header in the buffer */
+void add_header_to_sd_card_file(struct SdCardFile *const sd_card_file);
 void add_firmware_info_to_sd_card_file(struct SdCardFile *const sd_card_file);
-uint32_t get_block_offset(const struct SdCardFile *const sd_card_file);
+/* Add a column title for the axes of a logger, like ",accel(x,z)" */
+void add_axes_title_to_sd_card_file(struct SdCardFile *const sd_card_file, const char *name, uint8_t axes);
 bool add_value_to_buffer(struct SdCardFile *const sd_card_file, uint8_t value);
-bool write_full_buffer_to_sd_card(struct SdCardFile *const sd_card_file);
-
-/* Only write remainder of buffer for end of file */
-bool write_remaining_buffer_to_sd_card(struct SdCardFile *const sd_card_file);
+/* Add a sample record to the file as a line of ascii values */
+bool add_sample_line_to_sd_card_file(struct SdCardFile *const sd_card_file, uint8_t *record, uint8_t record_size);
+/* Count the time covered by a sample toward the next checkpoint */
+void add_time_to_sd_card_file(struct SdCardFile *const sd_card_file, uint32_t delta_time);
+/* Commit the file's size to its directory table entry if a checkpoint is due */
+bool checkpoint_sd_card_file(struct SdCardFile *const sd_card_file);
+/* Clusters to reserve for a burst capture */
+uint16_t burst_clusters(void);
+/* Whether the burst capture has its samples or its run of clusters is full */
+bool burst_done(const struct SdCardFile *const sd_card_file);
+/* Add a sample to a burst file as a raw record */
+bool add_record_to_sd_card_file(struct SdCardFile *const sd_card_file, const uint8_t *record);
+/* Power on the SD card for a batch of samples */
+void wake_sd_card(void);
+/* Write the batch's full blocks and power off the SD card */
+bool rest_sd_card(struct SdCardFile *const sd_card_file);
+/* Advance the background write of the file */
+bool step_sd_card_file(struct SdCardFile *const sd_card_file);
+/* Make sure the main loop wakes to step the SD card write in progress */
+void schedule_sd_poll(const struct SdCardFile *const sd_card_file);
+/* Sleep in LPM0 until an event is posted, then return and clear the events */
+uint8_t wait_for_events(void);
+#ifdef BENCHMARK
+/* Add a line with the cost of the session's checkpoints */
+void add_checkpoint_cost_to_sd_card_file(struct SdCardFile *const sd_card_file);
+/* Add a line with the SD card write latency histogram */
+void add_write_latency_to_sd_card_file(struct SdCardFile *const sd_card_file);
+#endif
+uint32_t get_time(void);
+/* Read the 24 bit timer and the count of its wraps together, with interrupts off */
+void read_timer(uint32_t *timestamp, uint16_t *overflows);
+/* Timer value extended by the count of 24 bit timer wraps */
+uint32_t get_long_time(void);
+/* Return true iff the file has reached the size or duration for rotation */
+bool rotation_due(const struct SdCardFile *const sd_card_file);
+/* Close the file (and the gyroscope stream's) and continue logging in a new one */
+bool rotate_sd_card_file(struct SdCardFile *const sd_card_file);
 void get_config_settings(void);
 void timer_interrupt_event(void);
-bool button_press_event_handled(void);
+bool button_press_event_handled(enum ButtonPress button_press);
+/* Get the time for a sample; return false if the timer interrupt had to run first */
+bool sample_time(uint32_t *timestamp);
+/* Timer ticks from one sample to the next, across a wrap of the 24 bit timer */
+uint32_t sample_delta_time(uint32_t prev_timestamp, uint32_t timestamp);
 bool sample_event_handled(void);
+bool gyro_sample_event_handled(void);
+/*
+ * Put a sample record in the buffer at the rate chosen by its decimator.
+ * Return the number of samples in the record that was buffered (0: none).
+ */
+uint8_t add_decimated_sample(struct SampleBuffer *buffer, struct Decimator *decimator, uint8_t *record);
+/* High watermark of a raw samples buffer for its decimator (0: no decimation) */
+uint16_t decimation_watermark(const struct SampleBuffer *buffer);
+/* Whether the gyroscope's axes go in the accelerometer's sample records */
+bool gyro_is_in_samples(void);
+/* Read the gyroscope's axes in use */
+void read_gyro(uint8_t *axes);
+/* Bytes of a sample record taken by the given axes */
+uint8_t axes_size(uint8_t axes);
+/* Choose the sample reader and record size for the loggers in use */
+void select_sample_reader(void);
+/* Read the axes of the loggers that are logged; the accelerometer is always read */
+void read_axes(uint8_t *axes, bool is_accel_logged, bool is_gyro_logged);
+void read_accel_axes(uint8_t *axes);
+void read_gyro_axes(uint8_t *axes);
+void read_accel_gyro_axes(uint8_t *axes);
+void read_no_axes(uint8_t *axes);
 bool timer_interrupt_triggered(void);
 void clear_timer_interrupt(void);
 bool button_interrupt_triggered(void);
-enum ButtonPress get_button_press(bool can_triple_tap);
-enum ButtonPress wait_for_button_release(void);
 
 /* High byte for continuous timer */
 volatile uint8_t time_cont;
 
+/* Number of times time_cont has wrapped */
+volatile uint16_t time_overflows;
+
+/* Events posted by interrupts (enum Event) */
+volatile uint8_t events;
+
+/* Raw samples buffered before the sample event is posted */
+uint16_t sample_watermark;
+
+/* Set by the Timer_A CCR1 interrupt to end a timer_delay() */
+volatile bool timer_delay_done;
+
+/* Timer ticks from the start of logging to the start of sampling */
+uint32_t startup_ticks;
+
 /* Time of last sample for getting delta timestamp for acceleration data for new sample */
 uint32_t timestamp_accel;
 
 /* Buffer for samples */
 struct SampleBuffer sample_buffer;
 
-/* Samples for buffer */
-volatile struct Sample samples[RAW_SAMPLE_BUFF_SIZE];
+/* Sample records for buffer */
+volatile uint8_t samples[RAW_SAMPLE_BUFF_SIZE * SAMPLE_RECORD_MAX];
+
+/* Reads the axes of the loggers in use into a sample record (see select_sample_reader) */
+void (*read_logger_axes)(uint8_t *axes);
 
 /* Buffer for button presses */
 struct ButtonPressBuffer button_press_buffer;
@@ -150,6 +469,24 @@ struct ButtonPressBuffer button_press_buffer;
 /* Button presses for buffer of button presses */
 volatile enum ButtonPress button_presses[BUTTON_BUFF_SIZE];
 
+/* Button press being classified by the Timer1_A CCR1 tick */
+struct ButtonGesture button_gesture;
+
+/* Buffer for LED pattern steps */
+struct LedPattern led_pattern;
+
+/* Steps for buffer of LED pattern steps */
+volatile struct LedStep led_steps[LED_STEP_BUFF_SIZE];
+
+/* Whether an LED pattern is being played */
+volatile bool led_is_playing;
+
+/* Filtered battery voltage, with BATTERY_LEVEL_FRAC_BITS fraction bits */
+uint16_t battery_level;
+
+/* Whether the filtered battery voltage is low */
+volatile bool battery_is_low;
+
 /* Whether the user can triple tap */
 bool triple_tap_enabled;
 
@@ -159,9 +496,44 @@ bool button_tap_flash_enabled;
 /* Information for SD FAT library */
 struct fatstruct fatinfo;
 
+/* Directory table index, built when the SD card is mounted */
+struct dirindex dirindex;
+
+/* Config cache at the start of information memory segment D (written with info_flash_write()) */
+#pragma location = 0x1800
+__no_init const struct ConfigCache config_cache;
+
+/* Whether the config cache is for the SD card in use and its config file */
+bool config_cache_is_current;
+
 /* Buffer for accelerometer sample data to write to SD card */
 struct SdCardFile sd_file;
 
+/* Buffer for the SD card files (split with gyro_file while the gyroscope has its own stream) */
+uint8_t sd_buffer[SD_SAMPLE_BUFF_SIZE];
+
+/* Log file for the gyroscope stream */
+struct SdCardFile gyro_file;
+
+/* Gyroscope stream settings */
+struct GyroStream gyro_stream;
+
+/* Buffer for gyroscope stream samples */
+struct SampleBuffer gyro_buffer;
+
+/* Time of last gyroscope stream sample for getting delta timestamp */
+uint32_t timestamp_gyro;
+
+/* Axes logged (bits 0-2: accelerometer x, y, z, bits 3-5: gyroscope x, y, z) */
+uint8_t channels;
+
+/* Percent of a raw samples buffer filled before its sample rate is lowered (0: never) */
+uint8_t decimation_percent;
+
+/* Lowers the sample rate while the raw samples buffers back up */
+struct Decimator decimator;
+struct Decimator gyro_decimator;
+
 /* Temporary variable for initializing the SD card using an SdCardFile's buffer */
 uint8_t *data_sd;
 
@@ -171,6 +543,48 @@ struct Logger accelerometer;
 /* Gyroscope settings */
 struct Logger gyroscope;
 
+/* Checkpoint settings */
+struct Checkpoint checkpoint;
+
+/* File rotation settings */
+struct Rotation rotation;
+
+/* SD card write speed */
+struct CardProbe sd_probe;
+
+/* Burst capture settings */
+struct Burst burst;
+
+/* Whether the SD card may be powered off between batches of samples */
+bool sd_gate_enabled;
+
+/* SD card power gating */
+struct SdGate sd_gate;
+
+/* Devices kept powered between logging sessions */
+struct WarmStart warm_start;
+
+/* Whether MCLK and the SD card SPI are running fast (see clock_fast) */
+bool clock_is_fast;
+
+/* Timer-synchronous sampling */
+struct SyncSampling sync_sampling;
+
+/* Whether the FLL is locked to the crystal (see xt1_start) */
+bool crystal_is_on;
+
+/* Whether orphaned clusters are recovered as files when logging starts */
+bool recovery_enabled;
+
+/* Whether the oldest data is overwritten when the SD card is full */
+bool ring_logging_enabled;
+
+#ifdef BENCHMARK
+/* Cost in timer ticks of the checkpoints taken while logging */
+uint32_t benchmark_checkpoint_min;
+uint32_t benchmark_checkpoint_max;
+#endif
+
 /* So that the LED doesn't flash multiple times per second */
 uint8_t prev_sec = 0;
 
@@ -192,34 +606,96 @@ void feed_watchdog(void) {
 
 void power_on_sd(void) {
 	power_on(SD_PWR);
+	sd_spi_on();
 	/* Needs a delay to complete powering-on */
-	POWER_ON_DELAY();
+	timer_delay(POWER_ON_TICKS);
+	init_sd_card();
+}
+
+void init_sd_card(void) {
+	/* The card is initialized at the normal SPI speed */
+	spia_normal();
 	/* Initialize SD card */
-	/* TODO may not necessarily need to init after each power-on */
 	if (init_sd() != SD_SUCCESS) {
 		/* Turn the LED on and hang to indicate failure */
-		led_1_on();
+		led_1_hold_on();
 		HANG();
 	}
+	if (clock_is_fast) {
+		spia_fast();
+	}
+}
+
+void clock_fast(void) {
+	/*
+	 * Timer_A and the SPI run from SMCLK, which stays at 12 MHz so timestamps
+	 * don't change. Between samples the CPU sleeps in LPM0 with MCLK off.
+	 */
+	vcore_set(VCORE_FAST);
+	mclk_fast();
+	spia_fast();
+	clock_is_fast = true;
+}
+
+void clock_normal(void) {
+	spia_normal();
+	mclk_normal();
+	vcore_set(VCORE_NORMAL);
+	clock_is_fast = false;
 }
 
 void power_off_sd(void) {
+	sd_spi_off();
 	power_off(SD_PWR);
 }
 
 void power_on_accelerometer(void) {
 	power_on(ACCEL_PWR);
 	/* Needs a delay to complete powering-on */
-	POWER_ON_DELAY();
+	timer_delay(POWER_ON_TICKS);
+	init_accelerometer();
+}
+
+void init_accelerometer(void) {
 	/* Initialize accelerometer */
-	/* TODO may not necessarily need to init after each power-on */
-	if (!init_accel(accelerometer.range, accelerometer.bandwidth)) {
+	if (!init_accel(accelerometer.range, accel_output_bandwidth(), accelerometer.axes)) {
 		/* Turn the LED on and hang to indicate failure */
-		led_1_on();
+		led_1_hold_on();
 		HANG();
 	}
 }
 
+uint8_t accel_output_bandwidth(void) {
+	/* Each tick reads a sample less than a quarter of a sample period old */
+	if (sync_sampling.is_active && accelerometer.bandwidth < bandwidth_bits_accel(2560)) {
+		return accelerometer.bandwidth + 1;
+	}
+	return accelerometer.bandwidth;
+}
+
+void start_sync_sampling(void) {
+	/* 40, 160 and 640 Hz divide 12 MHz into a whole number of ticks */
+	sync_sampling.period = TIMER_TICKS_PER_SECOND / bandwidth_bits_to_hz_accel(accelerometer.bandwidth);
+	sync_sampling.min_ticks = 0xFFFFFFFF;
+	sync_sampling.max_ticks = 0;
+	sync_sampling.has_sample = false;
+	timer2_start(sync_sampling.period);
+}
+
+void record_sync_ticks(uint32_t ticks) {
+	/* The first sample is timed from the start of sampling */
+	if (!sync_sampling.has_sample) {
+		sync_sampling.has_sample = true;
+		return;
+	}
+	if (ticks < sync_sampling.min_ticks) {
+		sync_sampling.min_ticks = ticks;
+	}
+	if (ticks > sync_sampling.max_ticks) {
+		sync_sampling.max_ticks = ticks;
+	}
+}
+
 void power_off_accelerometer(void) {
 	/* So accelerometer interrupt is low */
 	accelerometer_empty_read();
@@ -230,12 +706,15 @@ void power_off_accelerometer(void) {
 void power_on_gyroscope(void) {
 	power_on(GYRO_PWR);
 	/* Needs a delay to complete powering-on */
-	POWER_ON_DELAY();
+	timer_delay(POWER_ON_TICKS);
+	init_gyroscope();
+}
+
+void init_gyroscope(void) {
 	/* Initialize gyroscope */
-	/* TODO may not necessarily need to init after each power-on */
-	if (!init_gyro(gyroscope.range, gyroscope.bandwidth)) {
+	if (!init_gyro(gyroscope.range, gyroscope.bandwidth, gyroscope.axes)) {
 		/* Turn the LED on and hang to indicate failure */
-		led_1_on();
+		led_1_hold_on();
 		HANG();
 	}
 }
@@ -245,11 +724,49 @@ void power_off_gyroscope(void) {
 	power_off(GYRO_PWR);
 }
 
+void keep_devices_warm(void) {
+	/* So accelerometer interrupt is low */
+	accelerometer_empty_read();
+	power_down_accel();
+	if (gyroscope.is_enabled) {
+		power_down_gyro();
+	}
+	warm_start.is_powered = true;
+	warm_start.gyro_is_on = gyroscope.is_enabled;
+	warm_start.range_accel = accelerometer.range;
+	warm_start.range_gyro = gyroscope.range;
+}
+
+void power_off_warm_devices(void) {
+	if (!warm_start.is_powered) {
+		return;
+	}
+	power_off(ACCEL_PWR | GYRO_PWR);
+	power_off_sd();
+	warm_start.is_powered = false;
+}
+
+void wake_accelerometer(void) {
+	if (!wake_accel(accelerometer.range, accel_output_bandwidth(), warm_start.range_accel, accelerometer.axes)) {
+		init_accelerometer();
+	}
+}
+
+void wake_gyroscope(void) {
+	if (!warm_start.gyro_is_on ||
+		!wake_gyro(gyroscope.range, gyroscope.bandwidth, warm_start.range_gyro, gyroscope.axes)) {
+		init_gyroscope();
+	}
+}
+
 void enable_button_pressing(bool enable_button_tap_flash, bool enable_triple_tap) {
 	button_tap_flash_enabled = enable_button_tap_flash;
 	triple_tap_enabled = enable_triple_tap;
 	/* Clear button press buffer */
 	clear_button_press_buffer(&button_press_buffer);
+	/* Forget any press that was being classified */
+	timer1_ccr1_stop();
+	cancel_button_gesture(&button_gesture);
 	/* Set button press interrupt to active to wait on enable_interrupts() */
 	activate_ctrl_interrupt();
 }
@@ -263,9 +780,30 @@ void accelerometer_empty_read(void) {
 	read_addr_accel(ACCEL_OUTZ_L);
 }
 
-bool voltage_is_low(void) {
+void measure_battery(void) {
+	__istate_t state = __get_interrupt_state();
+	disable_interrupts();
 	uint16_t voltage = adc_read();
-	if (voltage < VOLTAGE_THRSHLD) {
+	battery_level = voltage << BATTERY_LEVEL_FRAC_BITS;
+	battery_is_low = (voltage < VOLTAGE_THRSHLD);
+	__set_interrupt_state(state);
+}
+
+void filter_battery_level(uint16_t voltage) {
+	int16_t difference = (int16_t)((voltage << BATTERY_LEVEL_FRAC_BITS) - battery_level);
+	battery_level += difference >> BATTERY_FILTER_SHIFT;
+	uint16_t level = battery_level >> BATTERY_LEVEL_FRAC_BITS;
+	/* Hysteresis keeps a sagging battery from flickering between states */
+	if (level < VOLTAGE_THRSHLD) {
+		battery_is_low = true;
+	} else if (level >= VOLTAGE_THRSHLD + VOLTAGE_HYSTERESIS) {
+		battery_is_low = false;
+	}
+}
+
+bool voltage_is_low(void) {
+	/* The battery is read on each RTC tick (see ADC_ISR) */
+	if (battery_is_low) {
 		/* Show low voltage with LED 1 */
 		led_1_low_voltage();
 		return true;
@@ -274,26 +812,21 @@ bool voltage_is_low(void) {
 }
 
 void led_1_panic(void) {
-	led_1_off();
-	for (uint8_t k = 0; k < 20; k++) {
-		led_1_toggle();
-		for (uint8_t j = 0; j < CLOCK_SPEED; j++) {
-			for (uint16_t i = 0; i < 8000; i++);
-		}
+	/* Replaces whatever was being shown */
+	stop_led_pattern();
+	for (uint8_t k = 0; k < LED_SIGNAL_FLASHES; k++) {
+		queue_led_step(true, LED_PANIC_MS);
+		queue_led_step(false, LED_PANIC_MS);
 	}
 }
 
 void led_1_low_voltage(void) {
-	for (uint8_t i = 0; i < 20; i++) {
-		if (i % 2 == 0) {
-			led_1_on();
-			LED_FLASH_DELAY(170);
-		} else {
-			led_1_off();
-			LED_FLASH_DELAY(10922);
-		}
+	/* Replaces whatever was being shown */
+	stop_led_pattern();
+	for (uint8_t k = 0; k < LED_SIGNAL_FLASHES; k++) {
+		queue_led_step(true, LED_LOW_VOLTAGE_ON_MS);
+		queue_led_step(false, LED_LOW_VOLTAGE_OFF_MS);
 	}
-	led_1_off();
 }
 
 bool flash_led_at_rate(uint8_t seconds) {
@@ -307,21 +840,84 @@ bool flash_led_at_rate(uint8_t seconds) {
 }
 
 void led_1_weak_flash(void) {
-	led_1_on();
-	LED_FLASH_DELAY(1000);
-	led_1_off();
+	queue_led_step(true, LED_WEAK_FLASH_MS);
 }
 
 void led_1_strong_flash(void) {
-	led_1_on();
-	LED_FLASH_DELAY(10000);
-	led_1_off();
+	queue_led_step(true, LED_STRONG_FLASH_MS);
 }
 
 void led_1_long_flash(void) {
+	queue_led_step(true, LED_LONG_FLASH_MS);
+}
+
+void led_1_triple_flash(void) {
+	queue_led_step(true, LED_STRONG_FLASH_MS);
+	queue_led_step(false, LED_TRIPLE_FLASH_GAP_MS);
+	queue_led_step(true, LED_STRONG_FLASH_MS);
+	queue_led_step(false, LED_TRIPLE_FLASH_GAP_MS);
+	queue_led_step(true, LED_STRONG_FLASH_MS);
+}
+
+void led_1_format_flash(void) {
+	queue_led_step(true, LED_WEAK_FLASH_MS);
+	queue_led_step(false, LED_FORMAT_FLASH_GAP_MS);
+	queue_led_step(true, LED_WEAK_FLASH_MS);
+}
+
+void led_1_hold_on(void) {
+	stop_led_pattern();
 	led_1_on();
-	LED_FLASH_DELAY(60000);
+}
+
+void queue_led_step(bool is_on, uint16_t ms) {
+	__istate_t state = __get_interrupt_state();
+	disable_interrupts();
+	/* A step that doesn't fit is dropped */
+	add_led_step(&led_pattern, is_on, LED_TICKS(ms));
+	if (!led_is_playing) {
+		next_led_step();
+	}
+	__set_interrupt_state(state);
+}
+
+bool next_led_step(void) {
+	struct LedStep step;
+	if (!remove_led_step(&led_pattern, &step)) {
+		timer1_ccr0_stop();
+		led_1_off();
+		led_is_playing = false;
+		return false;
+	}
+	if (step.is_on) {
+		led_1_on();
+	} else {
+		led_1_off();
+	}
+	timer1_ccr0_start(step.duration);
+	led_is_playing = true;
+	return true;
+}
+
+void stop_led_pattern(void) {
+	__istate_t state = __get_interrupt_state();
+	disable_interrupts();
+	timer1_ccr0_stop();
+	clear_led_pattern(&led_pattern);
+	led_is_playing = false;
 	led_1_off();
+	__set_interrupt_state(state);
+}
+
+void wait_for_led(void) {
+	__istate_t state = __get_interrupt_state();
+	disable_interrupts();
+	/* ACLK keeps the timer running in LPM0 */
+	while (led_is_playing) {
+		__bis_SR_register(LPM0_bits | GIE);
+		disable_interrupts();
+	}
+	__set_interrupt_state(state);
 }
 
 /* Return int for compiler compatibility */
@@ -353,18 +949,43 @@ int main(void) {
 
 void init(void) {
 	/* Construct data buffers */
-	construct_sample_buffer(&sample_buffer, samples, RAW_SAMPLE_BUFF_SIZE);
+	construct_sample_buffer(&sample_buffer, samples, sizeof(samples), SAMPLE_RECORD_MAX);
 	construct_button_press_buffer(&button_press_buffer, button_presses, BUTTON_BUFF_SIZE);
+	construct_led_pattern(&led_pattern, led_steps, LED_STEP_BUFF_SIZE);
+	construct_button_gesture(&button_gesture,
+							BUTTON_DEBOUNCE_MS / BUTTON_TICK_MS,
+							BUTTON_HOLD_TIME * 1000U / BUTTON_TICK_MS,
+							BUTTON_TIME_WINDOW * 1000U / BUTTON_TICK_MS);
 	/* Point pointer to buffer */
+	sd_file.buffer = sd_buffer;
 	data_sd = sd_file.buffer;
+	{
+		/* Name of log file */
+		uint8_t file_name[] = FILE_NAME;
+		construct_file(&sd_file.file, &fatinfo, &dirindex, file_name,
+						(const uint8_t *)"CSV", sd_file.buffer, SD_SAMPLE_BUFF_SIZE);
+	}
+	{
+		/* Name of gyroscope stream log file */
+		uint8_t file_name[] = GYRO_FILE_NAME;
+		gyro_file.buffer = sd_buffer + SD_SAMPLE_BUFF_SIZE / 2;
+		construct_file(&gyro_file.file, &fatinfo, &dirindex, file_name,
+						(const uint8_t *)"CSV", gyro_file.buffer, SD_SAMPLE_BUFF_SIZE / 2);
+	}
+	/* File data is written in the background, timed by Timer_A */
+	construct_writer(&fatinfo.writer, get_time, SD_WRITE_TIMEOUT);
 	/* Watchdog timer is on by default */
 	stop_watchdog();
 	/* Set up and configure the clock */
 	clock_config();
 	/* Configure MCU pins */
 	mcu_pin_config();
+	/* Lock the clock to the crystal if it starts */
+	mcu_xt_pins();
+	crystal_is_on = xt1_start();
 	/* Set up ADC */
 	adc_config();
+	measure_battery();
 	/* Set up SPI for MCU */
 	spi_config();
 	/* Start the watchdog */
@@ -373,9 +994,13 @@ void init(void) {
 	deactivate_interrupts();
 	/* Start the timer */
 	timer_config();
+	/* Start the timer for the LED and button */
+	timer1_config();
 }
 
 void restart(void) {
+	/* Let the LED finish showing why */
+	wait_for_led();
 	/* Trigger a brownout reset */
 	brownout_reset();
 }
@@ -392,8 +1017,11 @@ enum DeviceState idle(void) {
 	 */
 	enable_button_pressing(true, false);
 	feed_watchdog();
+	/* The battery isn't read while the device is off */
+	measure_battery();
 	/* Set up the clock to flash the LED */
 	rtc_restart();
+	rtc_tick_on();
 	prev_sec = RTCSEC;
 	feed_watchdog();
 	enable_interrupts();
@@ -402,9 +1030,12 @@ enum DeviceState idle(void) {
 
 enum DeviceState turn_off(void) {
 	feed_watchdog();
+	power_off_warm_devices();
 	/* Make sure the LED is off */
 	led_1_off();
 	disable_interrupts();
+	/* The RTC tick would wake the device from low power mode */
+	rtc_tick_off();
 	/* We have features which require triple tapping when device is off */
 	feed_watchdog();
 	enable_button_pressing(false, true);
@@ -415,90 +1046,194 @@ enum DeviceState turn_off(void) {
 
 enum DeviceState start_logging(void) {
 	feed_watchdog();
-	/* Turn on power to SD card and read the FAT boot sector */
-	power_on_sd();
+	uint32_t start_time = get_long_time();
+	/* Devices kept powered since the last session only need to be checked */
+	bool is_warm = warm_start.is_powered;
+	warm_start.is_powered = false;
+	if (is_warm) {
+		if (!warm_start.gyro_is_on) {
+			power_on(GYRO_PWR);
+			/* Needs a delay to complete powering-on */
+			timer_delay(POWER_ON_TICKS);
+		}
+		if (status_sd() != SD_SUCCESS) {
+			init_sd_card();
+		}
+	} else {
+		/*
+		 * Power everything at once so the sensors' regulators ramp up while the SD
+		 * card initializes and the config is read. The gyroscope is powered off
+		 * again if the config disables it.
+		 */
+		power_on(SD_PWR | ACCEL_PWR | GYRO_PWR);
+		sd_spi_on();
+		/* Needs a delay to complete powering-on */
+		timer_delay(POWER_ON_TICKS);
+		/* Initialize the SD card */
+		init_sd_card();
+	}
 	feed_watchdog();
 	/* Check for low voltage */
 	if (voltage_is_low()) {
 		restart();
 	}
 	feed_watchdog();
+	/* The session (including the card probe) runs with the fast clock */
+	clock_fast();
 	init_sd_fat();
+	/* The card may have been swapped, so its write speed is probed again */
+	sd_probe.is_valid = false;
 	feed_watchdog();
 	/*  
-	 * We parse the config file each time we want to start logging so the user doesn't
+	 * We check the config file each time we want to start logging so the user doesn't
 	 * have to restart the device manually each time they modify the config settings.
-	 * NOTE if this ever proves too slow or too power hungry, we can do this in device
-	 * turn on state.
+	 * It is only parsed when it has changed since the last time (see init_sd_fat).
 	 */
 	get_config_settings();
+	feed_watchdog();
+	if (recovery_enabled) {
+		/* Give clusters left by a session that was cut off a directory table entry */
+		recover_sd_card_files();
+	}
+	feed_watchdog();
+	/* The gyroscope has its own stream at its own rate unless the samples go in one file */
+	gyro_stream.is_active = gyro_stream.sample_rate > 0 && gyroscope.is_enabled &&
+							burst.seconds == 0 && !sync_sampling.is_enabled;
+	if (gyro_stream.is_active) {
+		gyroscope.bandwidth = bandwidth_bits_gyro(gyro_stream.sample_rate);
+	}
+	/* The record size sets the burst file's size */
+	select_sample_reader();
+	feed_watchdog();
+	/* Claim the file's first cluster while the timer still keeps time for the card probe */
+	open_sd_card_file(&sd_file);
+	if (gyro_stream.is_active) {
+		open_sd_card_file(&gyro_file);
+	}
 	disable_interrupts();
 	feed_watchdog();
 	enable_button_pressing(true, false);
-	/* Power on logging devices and activate interrupts */
+	/* Initialize logging devices (already powered on) and activate interrupts */
 	feed_watchdog();
+	sync_sampling.is_active = sync_sampling.is_enabled;
 	/* Accelerometer is always turned on since we use its interrupt to grab samples */
 	{
-		power_on_accelerometer();
-		activate_accel_interrupt();
+		if (is_warm) {
+			wake_accelerometer();
+		} else {
+			init_accelerometer();
+		}
+		/* Sync sampling is paced by the timer instead */
+		if (!sync_sampling.is_active) {
+			activate_accel_interrupt();
+		}
 	}
 	feed_watchdog();
 	if (gyroscope.is_enabled) {
-		power_on_gyroscope();
+		if (is_warm) {
+			wake_gyroscope();
+		} else {
+			init_gyroscope();
+		}
+		if (gyro_stream.is_active) {
+			activate_gyro_interrupt();
+		}
+	} else {
+		power_off(GYRO_PWR);
 	}
 	feed_watchdog();
-	new_sd_card_file(&sd_file);
-	feed_watchdog();
+	startup_ticks = get_long_time() - start_time;
+	/* Power the SD card off between batches at low sample rates */
+	sd_gate.is_active = sd_gate_enabled && burst.seconds == 0 && !gyro_stream.is_active &&
+						bandwidth_bits_to_hz_accel(accelerometer.bandwidth) == SD_GATE_SAMPLE_RATE;
+	sd_gate.card_is_on = true;
+	sd_gate.wakes = 0;
+	/* Nothing can be done with fewer samples than a batch while the card is off */
+	sample_watermark = sd_gate.is_active ? SD_GATE_BATCH_SAMPLES : SAMPLE_WATERMARK;
 	/* Clear raw samples buffer */
 	clear_sample_buffer(&sample_buffer);
+	construct_decimator(&decimator, (sample_buffer.record_size - SAMPLE_DT_SIZE) / 2,
+						bandwidth_bits_to_hz_accel(accelerometer.bandwidth),
+						decimation_watermark(&sample_buffer), sample_buffer.capacity, DECIMATION_MAX_LEVEL);
+	if (gyro_stream.is_active) {
+		clear_sample_buffer(&gyro_buffer);
+		construct_decimator(&gyro_decimator, (gyro_buffer.record_size - SAMPLE_DT_SIZE) / 2, gyro_stream.sample_rate,
+							decimation_watermark(&gyro_buffer), gyro_buffer.capacity, DECIMATION_MAX_LEVEL);
+	}
+	/* The header shows whether the sample rate can change */
+	add_header_to_sd_card_file(&sd_file);
+	if (gyro_stream.is_active) {
+		add_header_to_sd_card_file(&gyro_file);
+	}
+	feed_watchdog();
 	/* Reset timer */
 	time_cont = 0;
 	/* Reset time of last sample */
 	timestamp_accel = 0;
+#ifdef BENCHMARK
+	benchmark_checkpoint_min = 0xFFFFFFFF;
+	benchmark_checkpoint_max = 0;
+#endif
+	timestamp_gyro = 0;
 	feed_watchdog();
 	/* Set up the clock to flash the LED */
 	rtc_restart();
+	rtc_tick_on();
 	prev_sec = RTCSEC;
 	feed_watchdog();
 	/* Start capturing samples */
+	if (sync_sampling.is_active) {
+		start_sync_sampling();
+	}
 	enable_interrupts();
 	/* Read accelerometer axes to get interrupt started */
 	accelerometer_empty_read();
+	/* and the gyroscope's, in case it already has data ready */
+	if (gyro_stream.is_active) {
+		uint8_t axes[SAMPLE_AXES_SIZE];
+		read_gyro(axes);
+	}
 	return LOG_STATE;
 }
 
 enum DeviceState stop_logging(void) {
+	/* The sensors are powered down next */
+	timer2_stop();
 	feed_watchdog();
-	/* Power off logging devices */
-	{
-		power_off_accelerometer();
-	}
+	/* Put logging devices into power down mode, keeping their power on for a while */
+	keep_devices_warm();
 	feed_watchdog();
-	if (gyroscope.is_enabled) {
-		power_off_gyroscope();
+	/* The SD card may be powered off between batches */
+	if (!sd_gate.card_is_on) {
+		wake_sd_card();
 	}
-	feed_watchdog();
-	/* Write final logger data in buffer and update the directory table */
+#ifdef BENCHMARK
+	add_checkpoint_cost_to_sd_card_file(&sd_file);
+	add_write_latency_to_sd_card_file(&sd_file);
+#endif
+	if (sync_sampling.is_active && burst.seconds == 0) {
+		add_sync_stats_to_sd_card_file(&sd_file);
+	}
+	/* Write final logger data in buffer and update the file's directory table entry */
 	{
-		write_remaining_buffer_to_sd_card(&sd_file);
-		/* Name of log file */
-		uint8_t file_name[] = FILE_NAME;
-		/* Get the number of the last log file */
-		uint16_t file_num = get_file_num(sd_file.buffer, &fatinfo, file_name);
-		if (update_dir_table(sd_file.buffer, 
-									&fatinfo, 
-									sd_file.start_cluster, 
-									sd_file.size,
-									file_name,
-									file_num) != FAT_SUCCESS) {
+		if (close_file(&sd_file.file) != FAT_SUCCESS) {
 			/* Turn the LED on and hang to indicate failure */
-			led_1_on();
+			led_1_hold_on();
+			HANG();
+		}
+		if (gyro_stream.is_active && close_file(&gyro_file.file) != FAT_SUCCESS) {
+			/* Turn the LED on and hang to indicate failure */
+			led_1_hold_on();
 			HANG();
 		}
 	}
+	clock_normal();
 	feed_watchdog();
-	/* Turn off power to SD card since writing is complete */
-	power_off_sd();
+	/* A low battery (which may have ended the session) can't spare power for a warm start */
+	if (battery_is_low) {
+		power_off_warm_devices();
+	}
+	/* Otherwise the SD card stays powered with the sensors until the warm start period ends */
 	return idle();
 }
 
@@ -513,6 +1248,8 @@ enum DeviceState format_card(void) {
 }
 
 enum DeviceState off_step(void) {
+	/* The LED timer would wake the device from low power mode */
+	wait_for_led();
 	/* Turn off the wdt before entering low power mode */
 	stop_watchdog();
 	/* Wait for button press in low power mode */
@@ -546,8 +1283,16 @@ enum DeviceState off_step(void) {
 }
 
 enum DeviceState idle_step(void) {
-	if (flash_led_at_rate(IDLE_FLASH_RATE)) {
-		led_1_weak_flash();
+	/* Nothing happens between RTC ticks and button presses */
+	uint8_t posted = wait_for_events();
+	if (posted & EVENT_TICK) {
+		if (flash_led_at_rate(IDLE_FLASH_RATE)) {
+			led_1_weak_flash();
+		}
+		/* The RTC was restarted when logging stopped */
+		if (warm_start.is_powered && rtc_rdy() && RTCMIN >= WARM_START_MINUTES) {
+			power_off_warm_devices();
+		}
 	}
 	/* Check for any button presses */
 	if (button_press_buffer.count > 0) {
@@ -570,154 +1315,132 @@ enum DeviceState idle_step(void) {
 }
 
 enum DeviceState log_step(void) {
-	/* Check for low voltage */
-	if (voltage_is_low()) {
+	/* Sleep until samples build up, the SD card needs a step, a button press or an RTC tick */
+	uint8_t posted = wait_for_events();
+	if (posted & EVENT_TICK) {
+		/* Check for low voltage */
+		if (voltage_is_low()) {
+			return stop_logging();
+		}
+#ifndef DEBUG
+		if (flash_led_at_rate(LOG_FLASH_RATE)) {
+			led_1_strong_flash();
+		}
+#endif
+	}
+	/* Keep the SD card write going without waiting on the card */
+	if (!step_sd_card_file(&sd_file)) {
 		return stop_logging();
 	}
-#ifndef DEBUG
-	if (flash_led_at_rate(LOG_FLASH_RATE)) {
-		led_1_strong_flash();
+	if (gyro_stream.is_active && !step_sd_card_file(&gyro_file)) {
+		return stop_logging();
 	}
-#endif
 	/* Process samples */
 	// TODO refactor this to its own function but for now...
-	/* Convert all current samples in raw buffer to ascii */
+	/* Convert the current samples in raw buffer to ascii */
 	uint16_t count = sample_buffer.count;
+	/* Leave the SD card off until a batch of samples has built up */
+	if (sd_gate.is_active && !sd_gate.card_is_on) {
+		if (count < SD_GATE_BATCH_SAMPLES) {
+			count = 0;
+		} else {
+			wake_sd_card();
+		}
+	}
+	/* A large backlog is processed over several passes so button presses are still seen */
+	bool is_sliced = count > LOG_SLICE_SAMPLES;
+	if (is_sliced) {
+		count = LOG_SLICE_SAMPLES;
+	}
 #ifdef DEBUG
 	if (count == 0) {
 		led_1_off();
-	} else if (count == RAW_SAMPLE_BUFF_SIZE) {
+	} else if (count == sample_buffer.capacity) {
 		led_1_on();
 	} else {
 		led_1_toggle();
 	}
 #endif
 	for (uint16_t i = 0; i < count; ++i) {
-		/* Grab a raw accelerometer sample */
-		struct Sample sample;
-		bool success = remove_sample(&sample_buffer, &sample);
+		/* Grab a raw sample record */
+		uint8_t record[SAMPLE_RECORD_MAX];
+		bool success = remove_sample(&sample_buffer, record);
 		if (!success) {
 #ifdef DEBUG
 			HANG();
 #endif
 		} else {
 			// TODO dear god, refactor this...
-			/* Sample is written on a new line */
-			if (!add_value_to_buffer(&sd_file, NEW_LINE)) {
+			if (!step_sd_card_file(&sd_file)) {
 				return stop_logging();
 			}
-			/* Convert delta time to ascii and put in SD card buffer */
-			{
-				int32_t delta_time = int8arr_to_uint32(sample.delta_time);
-				/* Max timestamp value is 8 digits */
-				uint8_t ascii_buffer[8];
-				uitoa(delta_time, ascii_buffer);
-				for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 8; ++i) {
-					if (!add_value_to_buffer(&sd_file, ascii_buffer[i])) {
-						return stop_logging();
-					}
+			/* A burst file takes raw records until the capture is over */
+			if (burst.seconds > 0) {
+				if (burst_done(&sd_file) || !add_record_to_sd_card_file(&sd_file, record)) {
+					return stop_logging();
 				}
+				continue;
+			}
+			/* Continue in a new file without interrupting the samples */
+			if (rotation_due(&sd_file) && !rotate_sd_card_file(&sd_file)) {
+				return stop_logging();
+			}
+			if (!add_sample_line_to_sd_card_file(&sd_file, record, sample_buffer.record_size)) {
+				return stop_logging();
 			}
-			if (accelerometer.is_enabled) {
-				/* Add delimiter */
-				if (!add_value_to_buffer(&sd_file, DELIMITER)) {
+		}
+	}
+	/* The gyroscope stream's samples go to its own file */
+	if (gyro_stream.is_active) {
+		uint16_t gyro_count = gyro_buffer.count;
+		if (gyro_count > LOG_SLICE_SAMPLES) {
+			gyro_count = LOG_SLICE_SAMPLES;
+			is_sliced = true;
+		}
+		for (uint16_t i = 0; i < gyro_count; ++i) {
+			uint8_t record[SAMPLE_DT_SIZE + SAMPLE_AXES_SIZE];
+			bool success = remove_sample(&gyro_buffer, record);
+			if (!success) {
+#ifdef DEBUG
+				HANG();
+#endif
+			} else {
+				if (!step_sd_card_file(&gyro_file)) {
 					return stop_logging();
 				}
-				/* Convert axes to ascii and put in SD card buffer */
-				{
-					/* Max axis value is 5 digits plus sign */
-					uint8_t ascii_buffer[6];
-					/* X-axis */
-					{
-						int16_t x_axis = int8arr_to_int16(sample.accel.x_axis);
-						itoa(x_axis, ascii_buffer);
-						for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 6; ++i) {
-							if (!add_value_to_buffer(&sd_file, ascii_buffer[i])) {
-								return stop_logging();
-							}
-						}
-					}
-					/* Add delimiter */
-					if (!add_value_to_buffer(&sd_file, DELIMITER)) {
-						return stop_logging();
-					}
-					/* Y-axis */
-					{
-						int16_t y_axis = int8arr_to_int16(sample.accel.y_axis);
-						itoa(y_axis, ascii_buffer);
-						for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 6; ++i) {
-							if (!add_value_to_buffer(&sd_file, ascii_buffer[i])) {
-								return stop_logging();
-							}
-						}
-					}
-					/* Add delimiter */
-					if (!add_value_to_buffer(&sd_file, DELIMITER)) {
-						return stop_logging();
-					}
-					/* Z-axis */
-					{
-						int16_t z_axis = int8arr_to_int16(sample.accel.z_axis);
-						itoa(z_axis, ascii_buffer);
-						for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 6; ++i) {
-							if (!add_value_to_buffer(&sd_file, ascii_buffer[i])) {
-								return stop_logging();
-							}
-						}
-					}
-				}
-			}
-			if (gyroscope.is_enabled) {
-				/* Add delimiter */
-				if (!add_value_to_buffer(&sd_file, DELIMITER)) {
+				/* Both files are rotated together */
+				if (rotation_due(&gyro_file) && !rotate_sd_card_file(&sd_file)) {
 					return stop_logging();
 				}
-				/* Convert axes to ascii and put in SD card buffer */
-				{
-					/* Max axis value is 5 digits plus sign */
-					uint8_t ascii_buffer[6];
-					/* X-axis */
-					{
-						int16_t x_axis = int8arr_to_int16(sample.gyro.x_axis);
-						itoa(x_axis, ascii_buffer);
-						for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 6; ++i) {
-							if (!add_value_to_buffer(&sd_file, ascii_buffer[i])) {
-								return stop_logging();
-							}
-						}
-					}
-					/* Add delimiter */
-					if (!add_value_to_buffer(&sd_file, DELIMITER)) {
-						return stop_logging();
-					}
-					/* Y-axis */
-					{
-						int16_t y_axis = int8arr_to_int16(sample.gyro.y_axis);
-						itoa(y_axis, ascii_buffer);
-						for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 6; ++i) {
-							if (!add_value_to_buffer(&sd_file, ascii_buffer[i])) {
-								return stop_logging();
-							}
-						}
-					}
-					/* Add delimiter */
-					if (!add_value_to_buffer(&sd_file, DELIMITER)) {
-						return stop_logging();
-					}
-					/* Z-axis */
-					{
-						int16_t z_axis = int8arr_to_int16(sample.gyro.z_axis);
-						itoa(z_axis, ascii_buffer);
-						for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 6; ++i) {
-							if (!add_value_to_buffer(&sd_file, ascii_buffer[i])) {
-								return stop_logging();
-							}
-						}
-					}
+				if (!add_sample_line_to_sd_card_file(&gyro_file, record, gyro_buffer.record_size)) {
+					return stop_logging();
 				}
 			}
 		}
 	}
+	if (is_sliced) {
+		/* Come straight back for the rest of the backlog */
+		events |= EVENT_SAMPLES;
+	} else {
+		/* Write the batch before the checkpoint so it covers the batch */
+		if (sd_gate.is_active && sd_gate.card_is_on && drain_file(&sd_file.file) != FAT_SUCCESS) {
+			return stop_logging();
+		}
+		/* Commit the file's size between writes */
+		if (!checkpoint_sd_card_file(&sd_file)) {
+			return stop_logging();
+		}
+		if (gyro_stream.is_active && !checkpoint_sd_card_file(&gyro_file)) {
+			return stop_logging();
+		}
+		if (sd_gate.is_active && sd_gate.card_is_on && !rest_sd_card(&sd_file)) {
+			return stop_logging();
+		}
+	}
+	schedule_sd_poll(&sd_file);
+	if (gyro_stream.is_active) {
+		schedule_sd_poll(&gyro_file);
+	}
 	/* Check for any button presses */
 	if (button_press_buffer.count > 0) {
 		enum ButtonPress button_press;
@@ -739,9 +1462,7 @@ enum DeviceState log_step(void) {
 
 enum DeviceState format_step(void) {
 	if (flash_led_at_rate(FORMAT_FLASH_RATE)) {
-		led_1_weak_flash();
-		LED_FLASH_DELAY(30000);
-		led_1_weak_flash();
+		led_1_format_flash();
 	}
 	/* Check for any button presses */
 	if (button_press_buffer.count > 0) {
@@ -766,19 +1487,137 @@ enum DeviceState format_step(void) {
 }
 
 void init_sd_fat(void) {
-	/* Find and read the FAT16 boot sector */
-	if (valid_boot_sector(data_sd, &fatinfo) != FAT_SUCCESS) {
-		/* Turn the LED on and hang to indicate failure */
-		led_1_on();
-		HANG();
-	}
-	/* Parse the FAT16 boot sector */
-	if (parse_boot_sector(data_sd, &fatinfo) != FAT_SUCCESS) {
-		/* Show failure with LED 1  */
-		led_1_panic();
-		/* Restart upon failure */
-		restart();
+	/*
+	 * The config cache is keyed by the CONFIG.INI entry, which only needs one block
+	 * read. If the entry is unchanged it is the same card, so the boot sector and
+	 * config file don't have to be parsed again.
+	 */
+	config_cache_is_current = config_cache.key == CONFIG_CACHE_KEY &&
+		same_config_entry(data_sd, &config_cache.dir);
+	if (config_cache_is_current) {
+		load_fat_geometry(&fatinfo, config_cache.geometry);
+	} else {
+		/* Find and read the FAT16 boot sector */
+		if (valid_boot_sector(data_sd, &fatinfo) != FAT_SUCCESS) {
+			/* Turn the LED on and hang to indicate failure */
+			led_1_hold_on();
+			HANG();
+		}
+		/* Parse the FAT16 boot sector */
+		if (parse_boot_sector(data_sd, &fatinfo) != FAT_SUCCESS) {
+			/* Show failure with LED 1  */
+			led_1_panic();
+			/* Restart upon failure */
+			restart();
+		}
 	}
+	/* Index the directory table so closing a file doesn't have to scan it */
+	uint8_t file_name[] = FILE_NAME;
+	build_dir_index(data_sd, &fatinfo, file_name, &dirindex);
+}
+
+void save_config_cache(const struct SettingValues *found) {
+	/* Without a config file there is nothing to recognize the card by */
+	if (dirindex.config_entry == DIR_INDEX_NONE || found->overflow) {
+		clear_config_cache();
+		return;
+	}
+	struct ConfigCache cache;
+	cache.key = CONFIG_CACHE_KEY;
+	cache.dir = dirindex;
+	save_fat_geometry(&fatinfo, cache.geometry);
+	cache.settings = *found;
+	info_flash_write((uint8_t *)&config_cache, (const uint8_t *)&cache, sizeof(cache));
+}
+
+void clear_config_cache(void) {
+	/* Erased flash is already invalid */
+	if (config_cache.key != CONFIG_CACHE_KEY) {
+		return;
+	}
+	uint16_t key = 0;
+	info_flash_write((uint8_t *)&config_cache, (const uint8_t *)&key, sizeof(key));
+}
+
+void probe_sd_card(struct SdCardFile *const sd_card_file) {
+	/* The new file's first cluster is empty, so it is used as scratch */
+	uint32_t start_offset = get_cluster_offset(sd_card_file->file.start_cluster, &fatinfo);
+	/* Writes can take a while on a slow card so we need to stop the wdt */
+	stop_watchdog();
+	for (uint8_t k = 0; k < SD_PROBE_SIZES; ++k) {
+		uint8_t blocks = k + 1;
+		uint8_t writes = fatinfo.nsectsinclust / blocks;
+		if (writes > SD_PROBE_WRITES) {
+			writes = SD_PROBE_WRITES;
+		}
+		if (probe_write_speed(&fatinfo, sd_card_file->buffer, start_offset, blocks, writes,
+								&sd_probe.mean_ticks[k], &sd_probe.worst_ticks[k]) != SD_SUCCESS) {
+			/* Turn the LED on and hang to indicate failure */
+			led_1_hold_on();
+			HANG();
+		}
+	}
+	start_watchdog();
+	sd_probe.is_valid = true;
+
+	/* Write each block as soon as it fills unless the card needs bigger writes to keep up */
+	uint16_t sample_rate = bandwidth_bits_to_hz_accel(accelerometer.bandwidth);
+	sd_probe.batch = SD_PROBE_SIZES;
+	for (uint8_t batch = 1; batch <= SD_PROBE_SIZES; ++batch) {
+		if (card_keeps_up(batch, sample_rate)) {
+			sd_probe.batch = batch;
+			break;
+		}
+	}
+	sd_probe.max_sample_rate = 0;
+	{
+		uint16_t sample_rates[] = { 640, 160, 40 };
+		for (uint8_t i = 0; i < 3 && sd_probe.max_sample_rate == 0; ++i) {
+			for (uint8_t batch = 1; batch <= SD_PROBE_SIZES; ++batch) {
+				if (card_keeps_up(batch, sample_rates[i])) {
+					sd_probe.max_sample_rate = sample_rates[i];
+					break;
+				}
+			}
+		}
+	}
+	/* Warn that samples will be dropped at the configured sample rate */
+	if (sd_probe.max_sample_rate < sample_rate) {
+		led_1_panic();
+	}
+}
+
+bool card_keeps_up(uint8_t batch, uint16_t sample_rate) {
+	uint32_t ticks_per_sample = TIMER_TICKS_PER_SECOND / sample_rate;
+	/* The card has to write a batch in the time the samples take to fill one */
+	uint32_t fill_ticks = (uint32_t)batch * 512 / max_sample_line_length() * ticks_per_sample;
+	/* and the raw samples buffer has to hold the samples taken during the slowest write */
+	uint32_t hold_ticks = RAW_SAMPLE_BUFF_SIZE * ticks_per_sample;
+	return sd_probe.mean_ticks[batch - 1] < fill_ticks && sd_probe.worst_ticks[batch - 1] < hold_ticks;
+}
+
+uint8_t max_sample_line_length(void) {
+	/* New line and delta time (8 digits) */
+	uint8_t length = 1 + 8;
+	/* Delimiter, sign and 5 digits for each axis */
+	if (accelerometer.is_enabled) {
+		length += 7 * (axes_size(accelerometer.axes) / 2);
+	}
+	if (gyro_is_in_samples()) {
+		length += 7 * (axes_size(gyroscope.axes) / 2);
+	}
+	return length;
+}
+
+void recover_sd_card_files(void) {
+	/* A chain could be from either stream, so it isn't named as a log file */
+	uint8_t file_name[] = RECOVERED_FILE_NAME;
+	/* Streaming the whole FAT can take a while so we need to stop the wdt */
+	stop_watchdog();
+	/* Logging hasn't started, so the raw samples buffer can be used as scratch */
+	recover_orphans(data_sd, &fatinfo, &dirindex, file_name,
+						(uint8_t *)samples, sizeof(samples));
+	start_watchdog();
 }
 
 void format_sd_card(void) {
@@ -786,7 +1625,8 @@ void format_sd_card(void) {
 	/* Turn on power to SD card */
 	power_on_sd();
 	feed_watchdog();
-	/* Check for low voltage */
+	/* Check for low voltage (the battery isn't read while the device is off) */
+	measure_battery();
 	if (voltage_is_low()) {
 		restart();
 	}
@@ -797,184 +1637,309 @@ void format_sd_card(void) {
 	} else {
 		fat_defaults(&fatinfo);
 	}
+	/* The LED shows the formatting progress */
+	wait_for_led();
+	/* The card's geometry may change */
+	clear_config_cache();
 	/* Formatting takes a while so we need to stop the wdt */
 	stop_watchdog();
+	clock_fast();
 	/* Format the SD card, using LED 1 to indicate it's being formatted */
 	format_sd(data_sd, &fatinfo, led_1_on, led_1_toggle, led_1_off);
 	restart();
 }
 
 void new_sd_card_file(struct SdCardFile *const sd_card_file) {
-	sd_card_file->start_cluster = find_cluster(sd_card_file->buffer, &fatinfo);
-	/* The SD card is full */
-	if (!sd_card_file->start_cluster) {
+	open_sd_card_file(sd_card_file);
+	add_header_to_sd_card_file(sd_card_file);
+}
+
+void open_sd_card_file(struct SdCardFile *const sd_card_file) {
+	sd_card_file->file.ring = ring_logging_enabled;
+	/* The gyroscope stream's file has the other half of the SD card buffer */
+	sd_card_file->file.buffer_size = gyro_stream.is_active ? SD_SAMPLE_BUFF_SIZE / 2 : SD_SAMPLE_BUFF_SIZE;
+	/* The gyroscope stream's file is numbered like the accelerometer's */
+	uint16_t file_num = (sd_card_file == &gyro_file) ? sd_file.file.file_num : 0;
+	{
+		uint8_t *ext = (uint8_t *)((burst.seconds > 0) ? "BIN" : "CSV");
+		for (uint8_t k = 0; k < 3; ++k) {
+			sd_card_file->file.ext[k] = ext[k];
+		}
+	}
+	if (burst.seconds > 0) {
+		/* Reserve the run of clusters for the whole capture */
+		if (open_burst_file(&sd_card_file->file, burst_clusters()) != FAT_SUCCESS) {
+			/* Turn the LED on and hang to indicate failure */
+			led_1_hold_on();
+			HANG();
+		}
+	} else if (open_file(&sd_card_file->file, file_num) != FAT_SUCCESS) {
+		/* Claim a cluster and the directory table entry */
 		/* Turn the LED on and hang to indicate failure */
-		led_1_on();
+		led_1_hold_on();
 		HANG();
 	}
-	sd_card_file->index = 0;
-	sd_card_file->cluster = sd_card_file->start_cluster;
-	sd_card_file->block_num = 0;
-	sd_card_file->size = 0;
+	if (!sd_probe.is_valid) {
+		probe_sd_card(sd_card_file);
+	}
+	sd_card_file->file.batch = sd_probe.batch;
+	if (sd_card_file->file.batch > sd_card_file->file.buffer_size / BLKSIZE) {
+		sd_card_file->file.batch = sd_card_file->file.buffer_size / BLKSIZE;
+	}
+	sd_card_file->checkpoint_seconds = 0;
+	sd_card_file->ticks = 0;
+	sd_card_file->seconds = 0;
+}
+
+void add_header_to_sd_card_file(struct SdCardFile *const sd_card_file) {
+	/* A gyroscope stream file has only the gyroscope's samples */
+	bool is_gyro_file = sd_card_file == &gyro_file;
+	bool has_accel = accelerometer.is_enabled && !is_gyro_file;
+	bool has_gyro = is_gyro_file || gyro_is_in_samples();
 	/* Firmware info */
 	add_firmware_info_to_sd_card_file(sd_card_file);
-	sd_card_file->buffer[sd_card_file->index++] = NEW_LINE;
+	sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
 //	feed_watchdog();
 	/* Sample rate */
-	sd_card_file->buffer[sd_card_file->index++] = 's';
-	sd_card_file->buffer[sd_card_file->index++] = 'a';
-	sd_card_file->buffer[sd_card_file->index++] = 'm';
-	sd_card_file->buffer[sd_card_file->index++] = 'p';
-	sd_card_file->buffer[sd_card_file->index++] = 'l';
-	sd_card_file->buffer[sd_card_file->index++] = 'e';
-	sd_card_file->buffer[sd_card_file->index++] = '-';
-	sd_card_file->buffer[sd_card_file->index++] = 'r';
-	sd_card_file->buffer[sd_card_file->index++] = 'a';
-	sd_card_file->buffer[sd_card_file->index++] = 't';
-	sd_card_file->buffer[sd_card_file->index++] = 'e';
-	sd_card_file->buffer[sd_card_file->index++] = ':';
-	sd_card_file->buffer[sd_card_file->index++] = ' ';
+	sd_card_file->buffer[sd_card_file->file.index++] = 's';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'a';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'm';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'p';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'l';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'e';
+	sd_card_file->buffer[sd_card_file->file.index++] = '-';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'r';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'a';
+	sd_card_file->buffer[sd_card_file->file.index++] = 't';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'e';
+	sd_card_file->buffer[sd_card_file->file.index++] = ':';
+	sd_card_file->buffer[sd_card_file->file.index++] = ' ';
 	/* Convert the sample rate to ascii */
 	{
 		uint8_t ascii_buffer[3];
-		itoa(bandwidth_bits_to_hz_accel(accelerometer.bandwidth), ascii_buffer);
+		itoa(is_gyro_file ? gyro_stream.sample_rate : bandwidth_bits_to_hz_accel(accelerometer.bandwidth), ascii_buffer);
 		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 3; ++i) {
-			sd_card_file->buffer[sd_card_file->index++] = ascii_buffer[i];
+			sd_card_file->buffer[sd_card_file->file.index++] = ascii_buffer[i];
 		}
 	}
-	sd_card_file->buffer[sd_card_file->index++] = ' ';
-	sd_card_file->buffer[sd_card_file->index++] = 'H';
-	sd_card_file->buffer[sd_card_file->index++] = 'z';
-	sd_card_file->buffer[sd_card_file->index++] = NEW_LINE;
+	sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'H';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'z';
+	sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
 //	feed_watchdog();
 	/* Range setting */
-	if (accelerometer.is_enabled) {
-		sd_card_file->buffer[sd_card_file->index++] = 'a';
-		sd_card_file->buffer[sd_card_file->index++] = 'c';
-		sd_card_file->buffer[sd_card_file->index++] = 'c';
-		sd_card_file->buffer[sd_card_file->index++] = 'e';
-		sd_card_file->buffer[sd_card_file->index++] = 'l';
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = 'r';
-		sd_card_file->buffer[sd_card_file->index++] = 'a';
-		sd_card_file->buffer[sd_card_file->index++] = 'n';
-		sd_card_file->buffer[sd_card_file->index++] = 'g';
-		sd_card_file->buffer[sd_card_file->index++] = 'e';
-		sd_card_file->buffer[sd_card_file->index++] = ':';
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = '+';
-		sd_card_file->buffer[sd_card_file->index++] = '/';
-		sd_card_file->buffer[sd_card_file->index++] = '-';
-		sd_card_file->buffer[sd_card_file->index++] = range_bits_to_g_accel(accelerometer.range) + 0x30;
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = 'g';
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = '(';
-		sd_card_file->buffer[sd_card_file->index++] = '+';
-		sd_card_file->buffer[sd_card_file->index++] = '/';
-		sd_card_file->buffer[sd_card_file->index++] = '-';
-		sd_card_file->buffer[sd_card_file->index++] = '3';
-		sd_card_file->buffer[sd_card_file->index++] = '2';
-		sd_card_file->buffer[sd_card_file->index++] = '7';
-		sd_card_file->buffer[sd_card_file->index++] = '6';
-		sd_card_file->buffer[sd_card_file->index++] = '8';
-		sd_card_file->buffer[sd_card_file->index++] = ')';
-		sd_card_file->buffer[sd_card_file->index++] = NEW_LINE;
-	}
-	if (gyroscope.is_enabled) {
-		sd_card_file->buffer[sd_card_file->index++] = 'g';
-		sd_card_file->buffer[sd_card_file->index++] = 'y';
-		sd_card_file->buffer[sd_card_file->index++] = 'r';
-		sd_card_file->buffer[sd_card_file->index++] = 'o';
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = 'r';
-		sd_card_file->buffer[sd_card_file->index++] = 'a';
-		sd_card_file->buffer[sd_card_file->index++] = 'n';
-		sd_card_file->buffer[sd_card_file->index++] = 'g';
-		sd_card_file->buffer[sd_card_file->index++] = 'e';
-		sd_card_file->buffer[sd_card_file->index++] = ':';
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = '+';
-		sd_card_file->buffer[sd_card_file->index++] = '/';
-		sd_card_file->buffer[sd_card_file->index++] = '-';
+	if (has_accel) {
+		sd_card_file->buffer[sd_card_file->file.index++] = 'a';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'c';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'c';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'e';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'l';
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'r';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'a';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'n';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'g';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'e';
+		sd_card_file->buffer[sd_card_file->file.index++] = ':';
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = '+';
+		sd_card_file->buffer[sd_card_file->file.index++] = '/';
+		sd_card_file->buffer[sd_card_file->file.index++] = '-';
+		sd_card_file->buffer[sd_card_file->file.index++] = range_bits_to_g_accel(accelerometer.range) + 0x30;
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'g';
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = '(';
+		sd_card_file->buffer[sd_card_file->file.index++] = '+';
+		sd_card_file->buffer[sd_card_file->file.index++] = '/';
+		sd_card_file->buffer[sd_card_file->file.index++] = '-';
+		sd_card_file->buffer[sd_card_file->file.index++] = '3';
+		sd_card_file->buffer[sd_card_file->file.index++] = '2';
+		sd_card_file->buffer[sd_card_file->file.index++] = '7';
+		sd_card_file->buffer[sd_card_file->file.index++] = '6';
+		sd_card_file->buffer[sd_card_file->file.index++] = '8';
+		sd_card_file->buffer[sd_card_file->file.index++] = ')';
+		sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
+	}
+	if (has_gyro) {
+		sd_card_file->buffer[sd_card_file->file.index++] = 'g';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'y';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'r';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'o';
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'r';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'a';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'n';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'g';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'e';
+		sd_card_file->buffer[sd_card_file->file.index++] = ':';
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = '+';
+		sd_card_file->buffer[sd_card_file->file.index++] = '/';
+		sd_card_file->buffer[sd_card_file->file.index++] = '-';
 		/* Convert the range to ascii */
 		{
 			uint8_t ascii_buffer[4];
 			itoa(range_bits_to_dps_gyro(gyroscope.range), ascii_buffer);
 			for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 4; ++i) {
-				sd_card_file->buffer[sd_card_file->index++] = ascii_buffer[i];
+				sd_card_file->buffer[sd_card_file->file.index++] = ascii_buffer[i];
 			}
 		}
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = 'd';
-		sd_card_file->buffer[sd_card_file->index++] = 'p';
-		sd_card_file->buffer[sd_card_file->index++] = 's';
-		sd_card_file->buffer[sd_card_file->index++] = ' ';
-		sd_card_file->buffer[sd_card_file->index++] = '(';
-		sd_card_file->buffer[sd_card_file->index++] = '+';
-		sd_card_file->buffer[sd_card_file->index++] = '/';
-		sd_card_file->buffer[sd_card_file->index++] = '-';
-		sd_card_file->buffer[sd_card_file->index++] = '3';
-		sd_card_file->buffer[sd_card_file->index++] = '2';
-		sd_card_file->buffer[sd_card_file->index++] = '7';
-		sd_card_file->buffer[sd_card_file->index++] = '6';
-		sd_card_file->buffer[sd_card_file->index++] = '8';
-		sd_card_file->buffer[sd_card_file->index++] = ')';
-		sd_card_file->buffer[sd_card_file->index++] = NEW_LINE;
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'd';
+		sd_card_file->buffer[sd_card_file->file.index++] = 'p';
+		sd_card_file->buffer[sd_card_file->file.index++] = 's';
+		sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+		sd_card_file->buffer[sd_card_file->file.index++] = '(';
+		sd_card_file->buffer[sd_card_file->file.index++] = '+';
+		sd_card_file->buffer[sd_card_file->file.index++] = '/';
+		sd_card_file->buffer[sd_card_file->file.index++] = '-';
+		sd_card_file->buffer[sd_card_file->file.index++] = '3';
+		sd_card_file->buffer[sd_card_file->file.index++] = '2';
+		sd_card_file->buffer[sd_card_file->file.index++] = '7';
+		sd_card_file->buffer[sd_card_file->file.index++] = '6';
+		sd_card_file->buffer[sd_card_file->file.index++] = '8';
+		sd_card_file->buffer[sd_card_file->file.index++] = ')';
+		sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
 	}
 	/* delta-time units */
-	sd_card_file->buffer[sd_card_file->index++] = 'd';
-	sd_card_file->buffer[sd_card_file->index++] = 't';
-	sd_card_file->buffer[sd_card_file->index++] = ' ';
-	sd_card_file->buffer[sd_card_file->index++] = 'u';
-	sd_card_file->buffer[sd_card_file->index++] = 'n';
-	sd_card_file->buffer[sd_card_file->index++] = 'i';
-	sd_card_file->buffer[sd_card_file->index++] = 't';
-	sd_card_file->buffer[sd_card_file->index++] = 's';
-	sd_card_file->buffer[sd_card_file->index++] = ':';
-	sd_card_file->buffer[sd_card_file->index++] = ' ';
-	sd_card_file->buffer[sd_card_file->index++] = '8';
-	sd_card_file->buffer[sd_card_file->index++] = '3';
-	sd_card_file->buffer[sd_card_file->index++] = '.';
-	sd_card_file->buffer[sd_card_file->index++] = '3';
-	sd_card_file->buffer[sd_card_file->index++] = '3';
-	sd_card_file->buffer[sd_card_file->index++] = ' ';
-	sd_card_file->buffer[sd_card_file->index++] = 'n';
-	sd_card_file->buffer[sd_card_file->index++] = 's';
-	sd_card_file->buffer[sd_card_file->index++] = NEW_LINE;
+	sd_card_file->buffer[sd_card_file->file.index++] = 'd';
+	sd_card_file->buffer[sd_card_file->file.index++] = 't';
+	sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'u';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'n';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'i';
+	sd_card_file->buffer[sd_card_file->file.index++] = 't';
+	sd_card_file->buffer[sd_card_file->file.index++] = 's';
+	sd_card_file->buffer[sd_card_file->file.index++] = ':';
+	sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+	sd_card_file->buffer[sd_card_file->file.index++] = '8';
+	sd_card_file->buffer[sd_card_file->file.index++] = '3';
+	sd_card_file->buffer[sd_card_file->file.index++] = '.';
+	sd_card_file->buffer[sd_card_file->file.index++] = '3';
+	sd_card_file->buffer[sd_card_file->file.index++] = '3';
+	sd_card_file->buffer[sd_card_file->file.index++] = ' ';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'n';
+	sd_card_file->buffer[sd_card_file->file.index++] = 's';
+	sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
+	/* SD card write speed */
+	add_card_probe_to_sd_card_file(sd_card_file);
+	/* Start-up time; the first sample's dt adds the wait for the first sample */
+	{
+		uint8_t title[] = "start-up ticks (tap to sampling): ";
+		for (uint8_t i = 0; title[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = title[i];
+		}
+		uint8_t ascii_buffer[11];
+		uitoa(startup_ticks, ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = ascii_buffer[i];
+		}
+		sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
+	}
+#ifdef BENCHMARK
+	{
+		uint8_t title[] = "metadata cache (hits,misses): ";
+		for (uint8_t i = 0; title[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = title[i];
+		}
+		uint32_t values[2] = { fatinfo.cache.hits, fatinfo.cache.misses };
+		for (uint8_t k = 0; k < 2; ++k) {
+			uint8_t ascii_buffer[11];
+			uitoa(values[k], ascii_buffer);
+			for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR; ++i) {
+				sd_card_file->buffer[sd_card_file->file.index++] = ascii_buffer[i];
+			}
+			sd_card_file->buffer[sd_card_file->file.index++] = (k < 1) ? DELIMITER : NEW_LINE;
+		}
+	}
+#endif
+	/* How a lower sample rate shows up in the samples */
+	{
+		const struct Decimator *file_decimator = is_gyro_file ? &gyro_decimator : &decimator;
+		if (file_decimator->high_watermark > 0) {
+			/* The marker only has the values its line has axes for */
+			const char *fields[] = {
+				"rate change marker (dt 16777215)",
+				(file_decimator->axes >= 1) ? ": new sample rate (Hz)" : "",
+				(file_decimator->axes >= 2) ? ",samples averaged per line" : ""
+			};
+			for (uint8_t k = 0; k < 3; ++k) {
+				for (uint8_t i = 0; fields[k][i] != NULL_TERMINATOR; ++i) {
+					sd_card_file->buffer[sd_card_file->file.index++] = fields[k][i];
+				}
+			}
+			sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
+		}
+	}
 //	feed_watchdog();
+	/* Raw records follow the header in a burst file */
+	if (burst.seconds > 0) {
+		uint8_t title[] = "raw records (";
+		for (uint8_t i = 0; title[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = title[i];
+		}
+		uint8_t ascii_buffer[3];
+		uitoa(sample_buffer.record_size, ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 3; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = ascii_buffer[i];
+		}
+		/* Only the channels in use are in the records */
+		{
+			uint8_t fields[] = " bytes): dt[3]";
+			for (uint8_t i = 0; fields[i] != NULL_TERMINATOR; ++i) {
+				sd_card_file->buffer[sd_card_file->file.index++] = fields[i];
+			}
+		}
+		if (has_accel) {
+			add_axes_title_to_sd_card_file(sd_card_file, "accel", accelerometer.axes);
+			sd_card_file->buffer[sd_card_file->file.index++] = '[';
+			sd_card_file->buffer[sd_card_file->file.index++] = '2';
+			sd_card_file->buffer[sd_card_file->file.index++] = ']';
+		}
+		if (has_gyro) {
+			add_axes_title_to_sd_card_file(sd_card_file, "gyro", gyroscope.axes);
+			sd_card_file->buffer[sd_card_file->file.index++] = '[';
+			sd_card_file->buffer[sd_card_file->file.index++] = '2';
+			sd_card_file->buffer[sd_card_file->file.index++] = ']';
+		}
+		{
+			uint8_t fields[] = " big-endian";
+			for (uint8_t i = 0; fields[i] != NULL_TERMINATOR; ++i) {
+				sd_card_file->buffer[sd_card_file->file.index++] = fields[i];
+			}
+		}
+		sd_card_file->buffer[sd_card_file->file.index++] = NEW_LINE;
+		return;
+	}
 	/* Column titles */
-	sd_card_file->buffer[sd_card_file->index++] = 'd';
-	sd_card_file->buffer[sd_card_file->index++] = 't';
-	if (accelerometer.is_enabled) {
-		sd_card_file->buffer[sd_card_file->index++] = ',';
-		sd_card_file->buffer[sd_card_file->index++] = 'a';
-		sd_card_file->buffer[sd_card_file->index++] = 'c';
-		sd_card_file->buffer[sd_card_file->index++] = 'c';
-		sd_card_file->buffer[sd_card_file->index++] = 'e';
-		sd_card_file->buffer[sd_card_file->index++] = 'l';
-		sd_card_file->buffer[sd_card_file->index++] = '(';
-		sd_card_file->buffer[sd_card_file->index++] = 'x';
-		sd_card_file->buffer[sd_card_file->index++] = ',';
-		sd_card_file->buffer[sd_card_file->index++] = 'y';
-		sd_card_file->buffer[sd_card_file->index++] = ',';
-		sd_card_file->buffer[sd_card_file->index++] = 'z';
-		sd_card_file->buffer[sd_card_file->index++] = ')';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'd';
+	sd_card_file->buffer[sd_card_file->file.index++] = 't';
+	if (has_accel) {
+		add_axes_title_to_sd_card_file(sd_card_file, "accel", accelerometer.axes);
 	}
-	if (gyroscope.is_enabled) {
-		sd_card_file->buffer[sd_card_file->index++] = ',';
-		sd_card_file->buffer[sd_card_file->index++] = 'g';
-		sd_card_file->buffer[sd_card_file->index++] = 'y';
-		sd_card_file->buffer[sd_card_file->index++] = 'r';
-		sd_card_file->buffer[sd_card_file->index++] = 'o';
-		sd_card_file->buffer[sd_card_file->index++] = '(';
-		sd_card_file->buffer[sd_card_file->index++] = 'x';
-		sd_card_file->buffer[sd_card_file->index++] = ',';
-		sd_card_file->buffer[sd_card_file->index++] = 'y';
-		sd_card_file->buffer[sd_card_file->index++] = ',';
-		sd_card_file->buffer[sd_card_file->index++] = 'z';
-		sd_card_file->buffer[sd_card_file->index++] = ')';
+	if (has_gyro) {
+		add_axes_title_to_sd_card_file(sd_card_file, "gyro", gyroscope.axes);
+	}
+}
+
+void add_axes_title_to_sd_card_file(struct SdCardFile *const sd_card_file, const char *name, uint8_t axes) {
+	sd_card_file->buffer[sd_card_file->file.index++] = ',';
+	for (uint8_t i = 0; name[i] != NULL_TERMINATOR; ++i) {
+		sd_card_file->buffer[sd_card_file->file.index++] = name[i];
+	}
+	sd_card_file->buffer[sd_card_file->file.index++] = '(';
+	bool is_first = true;
+	for (uint8_t k = 0; k < 3; ++k) {
+		if (axes & (1 << k)) {
+			if (!is_first) {
+				sd_card_file->buffer[sd_card_file->file.index++] = ',';
+			}
+			sd_card_file->buffer[sd_card_file->file.index++] = 'x' + k;
+			is_first = false;
+		}
 	}
+	sd_card_file->buffer[sd_card_file->file.index++] = ')';
 }
 
 void add_firmware_info_to_sd_card_file(struct SdCardFile *const sd_card_file) {
@@ -982,137 +1947,367 @@ void add_firmware_info_to_sd_card_file(struct SdCardFile *const sd_card_file) {
 	uint8_t version[] = FIRMWARE_VERSION;
 	/* Add firmware name */
 	for (uint8_t i = 0; name[i] != NULL_TERMINATOR; ++i) {
-		sd_card_file->buffer[sd_card_file->index++] = name[i];
+		sd_card_file->buffer[sd_card_file->file.index++] = name[i];
 	}
-	sd_card_file->buffer[sd_card_file->index++] = ' ';
+	sd_card_file->buffer[sd_card_file->file.index++] = ' ';
 	/* Add firmware version */
-	sd_card_file->buffer[sd_card_file->index++] = 'v';
+	sd_card_file->buffer[sd_card_file->file.index++] = 'v';
 	for (uint8_t i = 0; version[i] != NULL_TERMINATOR; ++i) {
-		sd_card_file->buffer[sd_card_file->index++] = version[i];
+		sd_card_file->buffer[sd_card_file->file.index++] = version[i];
 	}
 }
 
-uint32_t get_block_offset(const struct SdCardFile *const sd_card_file) {
-	uint32_t block_offset = sd_card_file->block_num;
-	block_offset *= BLKSIZE;
-	block_offset += get_cluster_offset(sd_card_file->cluster, &fatinfo);
-	return block_offset;
+void add_card_probe_to_sd_card_file(struct SdCardFile *const sd_card_file) {
+	uint8_t title[] = "sd write ticks (";
+	for (uint8_t i = 0; title[i] != NULL_TERMINATOR; ++i) {
+		sd_card_file->buffer[sd_card_file->file.index++] = title[i];
+	}
+	/* A mean and worst column for each probed write size */
+	for (uint8_t k = 0; k < SD_PROBE_SIZES; ++k) {
+		uint8_t ascii_buffer[11];
+		uitoa(k + 1, ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = ascii_buffer[i];
+		}
+		uint8_t unit[] = " block";
+		for (uint8_t i = 0; unit[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = unit[i];
+		}
+		if (k > 0) {
+			sd_card_file->buffer[sd_card_file->file.index++] = 's';
+		}
+		uint8_t columns[] = " mean,worst";
+		for (uint8_t i = 0; columns[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = columns[i];
+		}
+		sd_card_file->buffer[sd_card_file->file.index++] = (k < SD_PROBE_SIZES - 1) ? DELIMITER : ')';
+	}
+	uint8_t title_end[] = ", batch, max sr: ";
+	for (uint8_t i = 0; title_end[i] != NULL_TERMINATOR; ++i) {
+		sd_card_file->buffer[sd_card_file->file.index++] = title_end[i];
+	}
+	uint32_t values[2 * SD_PROBE_SIZES + 2];
+	for (uint8_t k = 0; k < SD_PROBE_SIZES; ++k) {
+		values[2 * k] = sd_probe.mean_ticks[k];
+		values[2 * k + 1] = sd_probe.worst_ticks[k];
+	}
+	values[2 * SD_PROBE_SIZES] = sd_probe.batch;
+	values[2 * SD_PROBE_SIZES + 1] = sd_probe.max_sample_rate;
+	for (uint8_t k = 0; k < 2 * SD_PROBE_SIZES + 2; ++k) {
+		uint8_t ascii_buffer[11];
+		uitoa(values[k], ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR; ++i) {
+			sd_card_file->buffer[sd_card_file->file.index++] = ascii_buffer[i];
+		}
+		sd_card_file->buffer[sd_card_file->file.index++] = (k < 2 * SD_PROBE_SIZES + 1) ? DELIMITER : NEW_LINE;
+	}
 }
 
 bool add_value_to_buffer(struct SdCardFile *const sd_card_file, uint8_t value) {
-	sd_card_file->buffer[sd_card_file->index++] = value;
-	if (!write_full_buffer_to_sd_card(sd_card_file)) {
+	if (append_file(&sd_card_file->file, value) != FAT_SUCCESS) {
+		/* Couldn't write the buffer or the SD card is full */
+#ifdef DEBUG
+		HANG();
+#endif
 		return false;
 	}
 	return true;
 }
 
-bool write_full_buffer_to_sd_card(struct SdCardFile *const sd_card_file) {
-	if (sd_card_file->index > SD_SAMPLE_BUFF_SIZE) {
-		/* Something went very wrong... */
-#ifdef DEBUG
-		HANG();
-#endif
+bool add_sample_line_to_sd_card_file(struct SdCardFile *const sd_card_file, uint8_t *record, uint8_t record_size) {
+	/* Sample is written on a new line */
+	if (!add_value_to_buffer(sd_card_file, NEW_LINE)) {
 		return false;
 	}
-	/* Buffer is full so write it to the SD card */
-	if (sd_card_file->index == SD_SAMPLE_BUFF_SIZE) {
-		/* Write entire buffer to SD card */
-		uint32_t block_offset = get_block_offset(sd_card_file);
-		uint8_t blocks = (uint16_t)SD_SAMPLE_BUFF_SIZE / BLKSIZE;
-		if (write_multiple_block(sd_card_file->buffer, block_offset, blocks) != SD_SUCCESS) {
-			/* Couldn't write blocks */
-#ifdef DEBUG
-			HANG();
-#endif
-			return false;
+	/* Convert delta time to ascii and put in SD card buffer */
+	{
+		int32_t delta_time = int8arr_to_uint32(record);
+		/* A rate change marker isn't time between samples */
+		if (delta_time != RATE_MARKER_DT) {
+			add_time_to_sd_card_file(sd_card_file, delta_time);
 		}
-		/* Prepare for writing next block */
-		sd_card_file->size += SD_SAMPLE_BUFF_SIZE;
-		sd_card_file->index = 0;
-		sd_card_file->block_num += blocks;
-		
-		/* Cluster is full */
-		if (!valid_block(sd_card_file->block_num, &fatinfo)) {
-			/* Find another cluster */
-			uint16_t next_cluster = find_cluster(sd_card_file->buffer, &fatinfo);
-			if (!next_cluster) {
-				/* Couldn't find another cluster; SD card is full */
-#ifdef DEBUG
-				HANG();
-#endif
+		/* Max timestamp value is 8 digits */
+		uint8_t ascii_buffer[8];
+		uitoa(delta_time, ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 8; ++i) {
+			if (!add_value_to_buffer(sd_card_file, ascii_buffer[i])) {
 				return false;
 			}
-			/* Update the FAT */
-			if (update_fat(sd_card_file->buffer, &fatinfo, sd_card_file->cluster * 2, next_cluster)) {
-				/* Couldn't update FAT */
-#ifdef DEBUG
-				HANG();
-#endif
+		}
+	}
+	/* Convert the axes in the record to ascii and put in SD card buffer */
+	for (uint8_t k = SAMPLE_DT_SIZE; k < record_size; k += 2) {
+		/* Add delimiter */
+		if (!add_value_to_buffer(sd_card_file, DELIMITER)) {
+			return false;
+		}
+		/* Max axis value is 5 digits plus sign */
+		uint8_t ascii_buffer[6];
+		int16_t axis = int8arr_to_int16(&record[k]);
+		itoa(axis, ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR && i < 6; ++i) {
+			if (!add_value_to_buffer(sd_card_file, ascii_buffer[i])) {
 				return false;
 			}
-			sd_card_file->cluster = next_cluster;
-			sd_card_file->block_num = 0;
 		}
 	}
 	return true;
 }
 
-bool write_remaining_buffer_to_sd_card(struct SdCardFile *const sd_card_file) {
-	if (sd_card_file->index > SD_SAMPLE_BUFF_SIZE) {
-		/* Something went very wrong... */
+uint16_t burst_clusters(void) {
+	uint16_t sample_rate = bandwidth_bits_to_hz_accel(accelerometer.bandwidth);
+	/* Records for the capture and the samples still buffered when it ends, plus the header */
+	uint32_t bytes = ((uint32_t)burst.seconds * sample_rate + sample_buffer.capacity) * sample_buffer.record_size;
+	bytes += SD_SAMPLE_BUFF_SIZE;
+	uint32_t clusters = (bytes + fatinfo.nbytesinclust - 1) / fatinfo.nbytesinclust;
+	if (clusters >= FAT_BAD_CLUST) {
+		clusters = FAT_BAD_CLUST - 1;
+	}
+	return clusters;
+}
+
+bool burst_done(const struct SdCardFile *const sd_card_file) {
+	if (sd_card_file->seconds >= burst.seconds) {
+		return true;
+	}
+	uint32_t capacity = (uint32_t)(sd_card_file->file.reserved_end - sd_card_file->file.start_cluster) * fatinfo.nbytesinclust;
+	return file_length(&sd_card_file->file) + sample_buffer.record_size > capacity;
+}
+
+bool add_record_to_sd_card_file(struct SdCardFile *const sd_card_file, const uint8_t *record) {
+	add_time_to_sd_card_file(sd_card_file, int8arr_to_uint32((uint8_t *)record));
+	for (uint8_t i = 0; i < sample_buffer.record_size; ++i) {
+		if (!add_value_to_buffer(sd_card_file, record[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void wake_sd_card(void) {
+	/* Powering on initializes the card; the FAT information and cache in RAM are still good */
+	power_on_sd();
+	sd_gate.card_is_on = true;
+	++sd_gate.wakes;
+}
+
+bool rest_sd_card(struct SdCardFile *const sd_card_file) {
+	/* The last partial block waits in RAM for the next batch */
+	if (drain_file(&sd_card_file->file) != FAT_SUCCESS) {
 #ifdef DEBUG
 		HANG();
 #endif
 		return false;
 	}
-	/* Write the remaining buffer data to SD card */
-	if (sd_card_file->index > BLKSIZE) {
-		/*
-		 * Do a multi block write followed by a single block write if not all
-		 * bytes were written: remaining bytes were not a multiple of BLKSIZE
-		 */
-		uint32_t block_offset = get_block_offset(sd_card_file);
-		uint8_t blocks = sd_card_file->index / BLKSIZE;
-		if (write_multiple_block(sd_card_file->buffer, block_offset, blocks) != SD_SUCCESS) {
-			/* Couldn't write blocks */
+	power_off_sd();
+	sd_gate.card_is_on = false;
+	return true;
+}
+
+bool step_sd_card_file(struct SdCardFile *const sd_card_file) {
+	if (step_file(&sd_card_file->file) != FAT_SUCCESS) {
+		/* Couldn't write the buffer or the SD card is full */
 #ifdef DEBUG
-			HANG();
+		HANG();
 #endif
-			return false;
-		}
-		uint16_t bytes_written = blocks * BLKSIZE;
-		sd_card_file->size += bytes_written;
-		sd_card_file->index = sd_card_file->index - bytes_written;
-		sd_card_file->block_num += blocks;
-		
-		/* Now write the single block */
-		if (sd_card_file->index > 0) {
-			/* Place bytes at beginning of buffer */
-			for (uint16_t i = 0; i < sd_card_file->index; ++i) {
-				sd_card_file->buffer[i] = sd_card_file->buffer[bytes_written + i];
-			}
-			/* Write the block */
-			block_offset = get_block_offset(sd_card_file);
-			if (write_block(sd_card_file->buffer, block_offset, sd_card_file->index) != SD_SUCCESS) {
-	#ifdef DEBUG
-				HANG();
-	#endif
-				return false;
+		return false;
+	}
+	return true;
+}
+
+void schedule_sd_poll(const struct SdCardFile *const sd_card_file) {
+	const struct sdfile *file = &sd_card_file->file;
+	switch (file->info->writer.state) {
+		case SD_WRITE_IDLE:
+			/* The next write starts once enough blocks have filled */
+			if (file->queued == 0 || file->queued < file->batch) {
+				return;
 			}
-			sd_card_file->size += sd_card_file->index;
-		}
-	} else {
-		/* Write the single block */
-		uint32_t block_offset = get_block_offset(sd_card_file);
-		if (write_block(sd_card_file->buffer, block_offset, sd_card_file->index) != SD_SUCCESS) {
-			/* Couldn't write block */
+			events |= EVENT_SD_POLL;
+			break;
+		case SD_WRITE_ISSUE:
+		case SD_WRITE_BUSY:
+		case SD_WRITE_STOP:
+			/* Waiting on the card, so check again shortly */
+			disable_interrupts();
+			TA0CCR2 = TA0R + SD_POLL_TICKS;
+			TA0CCTL2 = CCIE;
+			enable_interrupts();
+			break;
+		default:
+			/* The next step doesn't wait on the card */
+			events |= EVENT_SD_POLL;
+			break;
+	}
+}
+
+uint8_t wait_for_events(void) {
+	disable_interrupts();
+	/* Interrupts are enabled on entering LPM0 so an event can't be missed in between */
+	while (events == 0) {
+		__bis_SR_register(LPM0_bits | GIE);
+		disable_interrupts();
+	}
+	uint8_t posted = events;
+	events = 0;
+	enable_interrupts();
+	return posted;
+}
+
+void add_time_to_sd_card_file(struct SdCardFile *const sd_card_file, uint32_t delta_time) {
+	sd_card_file->ticks += delta_time;
+	while (sd_card_file->ticks >= TIMER_TICKS_PER_SECOND) {
+		sd_card_file->ticks -= TIMER_TICKS_PER_SECOND;
+		++sd_card_file->checkpoint_seconds;
+		++sd_card_file->seconds;
+	}
+}
+
+bool checkpoint_sd_card_file(struct SdCardFile *const sd_card_file) {
+	bool due = (checkpoint.clusters > 0 && sd_card_file->file.unsynced_clusters >= checkpoint.clusters) ||
+				(checkpoint.seconds > 0 && sd_card_file->checkpoint_seconds >= checkpoint.seconds);
+	/*
+	 * Wait for the write in progress rather than block on it. A burst file has
+	 * no entry on the card until it is closed.
+	 */
+	if (!due || fatinfo.writer.state != SD_WRITE_IDLE || burst.seconds > 0 || !sd_gate.card_is_on) {
+		return true;
+	}
+	/*
+	 * The FAT and directory table sectors are cached, so this writes back the
+	 * FAT sector with the new links and the directory table sector without
+	 * reading either of them
+	 */
+#ifdef BENCHMARK
+	uint32_t start = get_time();
+#endif
+	if (sync_file(&sd_card_file->file) != FAT_SUCCESS) {
 #ifdef DEBUG
-			HANG();
+		HANG();
 #endif
-			return false;
+		return false;
+	}
+#ifdef BENCHMARK
+	uint32_t ticks = (get_time() - start) & SD_TIME_MASK;
+	if (ticks < benchmark_checkpoint_min) {
+		benchmark_checkpoint_min = ticks;
+	}
+	if (ticks > benchmark_checkpoint_max) {
+		benchmark_checkpoint_max = ticks;
+	}
+#endif
+	sd_card_file->checkpoint_seconds = 0;
+	return true;
+}
+
+#ifdef BENCHMARK
+void add_checkpoint_cost_to_sd_card_file(struct SdCardFile *const sd_card_file) {
+	/*
+	 * Cost of the session's checkpoints against the time the raw buffer can
+	 * hold samples at 640 Hz, all in timer ticks
+	 */
+	uint8_t title[] = "checkpoint ticks (min,max,640 Hz headroom): ";
+	add_value_to_buffer(sd_card_file, NEW_LINE);
+	for (uint8_t i = 0; title[i] != NULL_TERMINATOR; ++i) {
+		add_value_to_buffer(sd_card_file, title[i]);
+	}
+	uint32_t values[3] = {
+		(benchmark_checkpoint_max > 0) ? benchmark_checkpoint_min : 0,
+		benchmark_checkpoint_max,
+		(uint32_t)RAW_SAMPLE_BUFF_SIZE * (TIMER_TICKS_PER_SECOND / 640)
+	};
+	for (uint8_t k = 0; k < 3; ++k) {
+		uint8_t ascii_buffer[11];
+		uitoa(values[k], ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR; ++i) {
+			add_value_to_buffer(sd_card_file, ascii_buffer[i]);
+		}
+		if (k < 2) {
+			add_value_to_buffer(sd_card_file, DELIMITER);
 		}
-		sd_card_file->size += sd_card_file->index;
+	}
+}
+
+void add_write_latency_to_sd_card_file(struct SdCardFile *const sd_card_file) {
+	/*
+	 * Bucket k counts writes under 2^(14+k) timer ticks (1.4 ms doubling up to
+	 * 350 ms at 12 MHz), the last bucket counts the rest
+	 */
+	uint8_t title[] = "sd write latency (log2 buckets from 2^14 ticks,timeouts,crc retries): ";
+	add_value_to_buffer(sd_card_file, NEW_LINE);
+	for (uint8_t i = 0; title[i] != NULL_TERMINATOR; ++i) {
+		add_value_to_buffer(sd_card_file, title[i]);
+	}
+	for (uint8_t k = 0; k <= SD_LATENCY_BUCKETS + 1; ++k) {
+		uint16_t value = fatinfo.writer.crc_retries;
+		if (k < SD_LATENCY_BUCKETS) {
+			value = fatinfo.writer.latency[k];
+		} else if (k == SD_LATENCY_BUCKETS) {
+			value = fatinfo.writer.timeouts;
+		}
+		uint8_t ascii_buffer[11];
+		uitoa(value, ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR; ++i) {
+			add_value_to_buffer(sd_card_file, ascii_buffer[i]);
+		}
+		if (k < SD_LATENCY_BUCKETS + 1) {
+			add_value_to_buffer(sd_card_file, DELIMITER);
+		}
+	}
+}
+#endif
+
+void add_sync_stats_to_sd_card_file(struct SdCardFile *const sd_card_file) {
+	uint8_t title[] = "sync sample ticks (period,min,max,crystal): ";
+	add_value_to_buffer(sd_card_file, NEW_LINE);
+	for (uint8_t i = 0; title[i] != NULL_TERMINATOR; ++i) {
+		add_value_to_buffer(sd_card_file, title[i]);
+	}
+	uint32_t values[4] = {
+		sync_sampling.period,
+		sync_sampling.max_ticks > 0 ? sync_sampling.min_ticks : 0,
+		sync_sampling.max_ticks,
+		crystal_is_on
+	};
+	for (uint8_t k = 0; k < 4; ++k) {
+		uint8_t ascii_buffer[11];
+		uitoa(values[k], ascii_buffer);
+		for (uint8_t i = 0; ascii_buffer[i] != NULL_TERMINATOR; ++i) {
+			add_value_to_buffer(sd_card_file, ascii_buffer[i]);
+		}
+		if (k < 3) {
+			add_value_to_buffer(sd_card_file, DELIMITER);
+		}
+	}
+}
+
+bool rotation_due(const struct SdCardFile *const sd_card_file) {
+	if (rotation.megabytes > 0 &&
+		(file_length(&sd_card_file->file) >> 20) >= rotation.megabytes) {
+		return true;
+	}
+	if (rotation.minutes > 0 && sd_card_file->seconds >= (uint32_t)rotation.minutes * 60) {
+		return true;
+	}
+	return false;
+}
+
+bool rotate_sd_card_file(struct SdCardFile *const sd_card_file) {
+	/* Close the file */
+	if (close_file(&sd_card_file->file) != FAT_SUCCESS) {
+		return false;
+	}
+	if (gyro_stream.is_active && close_file(&gyro_file.file) != FAT_SUCCESS) {
+		return false;
+	}
+	/*
+	 * The directory table index and the free cluster search cursor are cached,
+	 * so the new file costs one FAT sector and one directory sector
+	 */
+	new_sd_card_file(sd_card_file);
+	/* The gyroscope stream continues in a file with the new number */
+	if (gyro_stream.is_active) {
+		new_sd_card_file(&gyro_file);
 	}
 	return true;
 }
@@ -1138,6 +2333,15 @@ void set_sample_rate(uint16_t bandwidth) {
 	gyroscope.bandwidth = bandwidth_bits_gyro(bandwidth);
 }
 
+void set_gyro_rate(uint16_t rate) {
+	/* Only the gyroscope's own data rates can run as a separate stream */
+	if (rate == 100 || rate == 200 || rate == 400 || rate == 800) {
+		gyro_stream.sample_rate = rate;
+	} else {
+		gyro_stream.sample_rate = 0;
+	}
+}
+
 void set_range_accel(uint16_t range) {
 	accelerometer.range = range_bits_accel(range);
 }
@@ -1162,6 +2366,69 @@ void set_disabled_gyro(uint16_t disabled) {
 	}
 }
 
+void set_checkpoint_seconds(uint16_t seconds) {
+	checkpoint.seconds = seconds;
+}
+
+void set_checkpoint_clusters(uint16_t clusters) {
+	checkpoint.clusters = clusters;
+}
+
+void set_rotation_megabytes(uint16_t megabytes) {
+	rotation.megabytes = megabytes;
+}
+
+void set_rotation_minutes(uint16_t minutes) {
+	rotation.minutes = minutes;
+}
+
+void set_burst_seconds(uint16_t seconds) {
+	burst.seconds = seconds;
+}
+
+void set_sd_gate(uint16_t enabled) {
+	if (enabled == 1) {
+		sd_gate_enabled = true;
+	} else {
+		sd_gate_enabled = false;
+	}
+}
+
+void set_disabled_recovery(uint16_t disabled) {
+	if (disabled == 1) {
+		recovery_enabled = false;
+	} else {
+		recovery_enabled = true;
+	}
+}
+
+void set_sync_sampling(uint16_t enabled) {
+	if (enabled == 1) {
+		sync_sampling.is_enabled = true;
+	} else {
+		sync_sampling.is_enabled = false;
+	}
+}
+
+void set_decimation_percent(uint16_t percent) {
+	if (percent >= 100) {
+		percent = 0;
+	}
+	decimation_percent = percent;
+}
+
+void set_channels(uint16_t mask) {
+	channels = mask & CHANNELS_ALL;
+}
+
+void set_ring_logging(uint16_t enabled) {
+	if (enabled == 1) {
+		ring_logging_enabled = true;
+	} else {
+		ring_logging_enabled = false;
+	}
+}
+
 void get_config_settings(void) {
 	/* Set default settings */
 	accelerometer.is_enabled = true;
@@ -1170,19 +2437,63 @@ void get_config_settings(void) {
 	gyroscope.is_enabled = true;
 	gyroscope.range = DEFAULT_RANGE_GYRO;
 	gyroscope.range = DEFAULT_BANDWIDTH_GYRO;
+	checkpoint.seconds = DEFAULT_CHECKPOINT_SECONDS;
+	checkpoint.clusters = DEFAULT_CHECKPOINT_CLUSTERS;
+	rotation.megabytes = 0;
+	rotation.minutes = 0;
+	recovery_enabled = true;
+	ring_logging_enabled = false;
+	burst.seconds = 0;
+	sd_gate_enabled = false;
+	sync_sampling.is_enabled = false;
+	gyro_stream.sample_rate = 0;
+	decimation_percent = 0;
+	channels = CHANNELS_ALL;
 	/* Override defaults with settings from config file */
-	struct Setting key_value_settings[4] = {
+	struct Setting key_value_settings[11] = {
 		{ .key = (uint8_t *)"sr", .set_value = set_sample_rate },
 		{ .key = (uint8_t *)"ar", .set_value = set_range_accel },
-		{ .key = (uint8_t *)"gr", .set_value = set_range_gyro }
+		{ .key = (uint8_t *)"gr", .set_value = set_range_gyro },
+		{ .key = (uint8_t *)"cp_sec", .set_value = set_checkpoint_seconds },
+		{ .key = (uint8_t *)"cp_clust", .set_value = set_checkpoint_clusters },
+		{ .key = (uint8_t *)"rot_mb", .set_value = set_rotation_megabytes },
+		{ .key = (uint8_t *)"rot_min", .set_value = set_rotation_minutes },
+		{ .key = (uint8_t *)"burst_sec", .set_value = set_burst_seconds },
+		{ .key = (uint8_t *)"gs", .set_value = set_gyro_rate },
+		{ .key = (uint8_t *)"decimate_pct", .set_value = set_decimation_percent },
+		{ .key = (uint8_t *)"channels", .set_value = set_channels }
 	};
-	struct Setting key_only_settings[2] = {
+	struct Setting key_only_settings[6] = {
 		{ .key = (uint8_t *)"disable_accel", .set_value = set_disabled_accel },
-		{ .key = (uint8_t *)"disable_gyro", .set_value = set_disabled_gyro }
+		{ .key = (uint8_t *)"disable_gyro", .set_value = set_disabled_gyro },
+		{ .key = (uint8_t *)"disable_recovery", .set_value = set_disabled_recovery },
+		{ .key = (uint8_t *)"ring_log", .set_value = set_ring_logging },
+		{ .key = (uint8_t *)"sd_gate", .set_value = set_sd_gate },
+		{ .key = (uint8_t *)"sync_sample", .set_value = set_sync_sampling }
 	};
-	set_key_value_settings(key_value_settings, 4);
-	set_key_only_settings(key_only_settings, 2);
-	get_user_config(data_sd, &fatinfo);
+	set_key_value_settings(key_value_settings, 11);
+	set_key_only_settings(key_only_settings, 6);
+	if (config_cache_is_current) {
+		/* Same config file as last time */
+		apply_setting_values(&config_cache.settings);
+	} else {
+		struct SettingValues found;
+		get_user_config(data_sd, &fatinfo, &dirindex, &found);
+		save_config_cache(&found);
+	}
+	/* A logger with none of its channels selected isn't logged */
+	accelerometer.axes = channels & AXES_ALL;
+	gyroscope.axes = (channels >> 3) & AXES_ALL;
+	if (accelerometer.axes == 0) {
+		accelerometer.is_enabled = false;
+	}
+	if (gyroscope.axes == 0) {
+		gyroscope.is_enabled = false;
+	}
+	/* The accelerometer's interrupt still paces the samples when it isn't logged */
+	if (!accelerometer.is_enabled) {
+		accelerometer.axes = AXES_ALL;
+	}
 }
 
 /*
@@ -1196,42 +2507,150 @@ __interrupt void CCR0_ISR(void) {
 
 void timer_interrupt_event(void) {
 	/* Increment high byte of timer */
-	++time_cont;
+	if (++time_cont == 0) {
+		++time_overflows;
+	}
 	/* Clear timer interrupt flag */
 	clear_timer_interrupt();
 }
 
+/*
+ * Interrupt Service Routine triggered on Timer_A CCR1 and CCR2 matches
+ * CCR1 ends a timer_delay() and CCR2 posts the SD card poll event.
+ */
+#pragma vector = TIMER0_A1_VECTOR
+__interrupt void CCR1_CCR2_ISR(void) {
+	uint16_t vector = TA0IV;
+	if (vector == TA0IV_TA0CCR1) {
+		TA0CCTL1 = 0;
+		timer_delay_done = true;
+		LPM0_EXIT;
+	} else if (vector == TA0IV_TA0CCR2) {
+		TA0CCTL2 = 0;
+		events |= EVENT_SD_POLL;
+		LPM0_EXIT;
+	}
+}
+
+/*
+ * Interrupt Service Routine triggered on Timer1_A CCR0 match
+ * Shows the next step of the LED pattern.
+ */
+#pragma vector = TIMER1_A0_VECTOR
+__interrupt void LED_ISR(void) {
+	if (!next_led_step()) {
+		/* Wake wait_for_led() */
+		LPM0_EXIT;
+	}
+}
+
+/*
+ * Interrupt Service Routine triggered on the RTC prescaler 1 interval
+ * Posts the RTC tick event.
+ */
+#pragma vector = RTC_VECTOR
+__interrupt void RTC_ISR(void) {
+	if (RTCIV == RTCIV_RT1PSIFG) {
+		/* Read the battery in the background (see ADC_ISR) */
+		adc_start();
+		events |= EVENT_TICK;
+		LPM0_EXIT;
+	}
+}
+
+/*
+ * Interrupt Service Routine triggered on ADC conversion complete
+ * Adds the battery reading started by RTC_ISR to the filtered battery level.
+ */
+#pragma vector = ADC10_VECTOR
+__interrupt void ADC_ISR(void) {
+	if (ADC10IV == ADC10IV_ADC10IFG) {
+		ADC10IE &= ~ADC10IE0;
+		filter_battery_level(ADC10MEM0);
+	}
+}
+
+/*
+ * Interrupt Service Routine triggered on Timer1_A CCR1 or overflow
+ * Steps the button gesture until the press is classified.
+ */
+#pragma vector = TIMER1_A1_VECTOR
+__interrupt void BUTTON_ISR(void) {
+	if (TA1IV != TA1IV_TA1CCR1) {
+		return;
+	}
+	enum ButtonPress button_press = step_button_gesture(&button_gesture, ctrl_high());
+	if (button_press == BUTTON_NONE) {
+		timer1_ccr1_next(LED_TICKS(BUTTON_TICK_MS));
+		return;
+	}
+	timer1_ccr1_stop();
+	bool success = button_press_event_handled(button_press);
+	/* Deactivate interrupts to prevent additional button presses and end sampling */
+	deactivate_interrupts();
+	if (success) {
+		events |= EVENT_BUTTON;
+		/* Wake up from low power mode; does nothing if not in low power mode */
+		LPM3_EXIT;
+	}
+}
+
 /*
  * Interrupt Service Routine triggered on Port 1 interrupt flag
- * This ISR handles 2 cases: accelerometer interrupt on new data
- * and CTRL button pressed down.
- * NOTE: This function uses the MSP430F5310 Real-Time Clock module
+ * This ISR handles 3 cases: accelerometer interrupt on new data,
+ * gyroscope interrupt on new data (only sampled for the gyroscope
+ * stream) and CTRL button pressed down.
+ * A button press only starts a gesture; BUTTON_ISR classifies it.
  */
 #pragma vector = PORT1_VECTOR
 __interrupt void PORT1_ISR(void) {
 	if (button_interrupt_triggered()) {
-		bool success = button_press_event_handled();
-		/* Deactivate interrupts to prevent additional button presses and end sampling */
-		deactivate_interrupts();
-		if (success) {
-			/* Wake up from low power mode; does nothing if not in low power mode */
-			LPM3_EXIT;
+		/* Further edges are bounces or part of this gesture */
+		deactivate_ctrl_interrupt();
+		if (press_button_gesture(&button_gesture, triple_tap_enabled)) {
+			timer1_ccr1_start(LED_TICKS(BUTTON_TICK_MS));
 		}
-		/* Clear the button interrupt flag */
-		clear_int_ctrl();
 	}
 	if (accel_int()) {
 		/* Accelerometer interrupt flag is cleared when axes are read */
-		/* Keep trying to handle the event until successful */
-		while (!sample_event_handled());
+		sample_event();
 		/* Clear the accelerometer interrupt flag */
 		clear_int_accel();
 	}
+	if (gyro_int()) {
+		if (gyro_stream.is_active) {
+			/* Keep trying to handle the event until successful */
+			while (!gyro_sample_event_handled());
+			if (gyro_buffer.count >= gyro_stream.watermark) {
+				events |= EVENT_SAMPLES;
+				LPM0_EXIT;
+			}
+		}
+		/* Clear the gyroscope interrupt flag */
+		clear_int_gyro();
+	}
+}
+
+/*
+ * Interrupt Service Routine triggered on Timer2_A CCR0 match
+ * Takes a sample of both sensors for sync sampling.
+ */
+#pragma vector = TIMER2_A0_VECTOR
+__interrupt void SYNC_ISR(void) {
+	sample_event();
+}
+
+void sample_event(void) {
+	/* Keep trying to handle the event until successful */
+	while (!sample_event_handled());
+	/* Wake the main loop once there are enough samples to be worth processing */
+	if (sample_buffer.count >= sample_watermark) {
+		events |= EVENT_SAMPLES;
+		LPM0_EXIT;
+	}
 }
 
-bool button_press_event_handled(void) {
-	/* Get button press */
-	enum ButtonPress button_press = get_button_press(triple_tap_enabled);
+bool button_press_event_handled(enum ButtonPress button_press) {
 	/* Put the button press data in the buffer */
 	bool success = add_button_press(&button_press_buffer, button_press);
 	if (!success) {
@@ -1251,21 +2670,17 @@ bool button_press_event_handled(void) {
 			led_1_long_flash();
 			break;
 		case BUTTON_TRIPLE_TAP:
-			led_1_strong_flash();
-			LED_FLASH_DELAY(10000);
-			led_1_strong_flash();
-			LED_FLASH_DELAY(10000);
-			led_1_strong_flash();
+			led_1_triple_flash();
 			break;
 	}
 	return true;
 }
 
-bool sample_event_handled(void) {
+bool sample_time(uint32_t *timestamp) {
 	/* Get the timestamp */
-	uint32_t timestamp = time_cont;
-	timestamp <<= 16;
-	timestamp += TA0R;
+	*timestamp = time_cont;
+	*timestamp <<= 16;
+	*timestamp += TA0R;
 	/* Let the timer interrupt run first and then capture sample */
 	if (timer_interrupt_triggered()) {
 //#ifdef DEBUG
@@ -1275,46 +2690,39 @@ bool sample_event_handled(void) {
 		timer_interrupt_event();
 		return false;
 	}
-	/* Calculate the delta timestamp for sample data using previous sample's timestamp */
-	uint32_t delta_time;
-	if (timestamp_accel <= timestamp) {
-		delta_time = timestamp - timestamp_accel;
-	} else {
-		delta_time = timestamp + (0x1000000 - timestamp_accel);
+	return true;
+}
+
+uint32_t sample_delta_time(uint32_t prev_timestamp, uint32_t timestamp) {
+	if (prev_timestamp <= timestamp) {
+		return timestamp - prev_timestamp;
+	}
+	return timestamp + (0x1000000 - prev_timestamp);
+}
+
+bool sample_event_handled(void) {
+	uint32_t timestamp;
+	if (!sample_time(&timestamp)) {
+		return false;
 	}
+	/* Calculate the delta timestamp for sample data using previous sample's timestamp */
+	uint32_t delta_time = sample_delta_time(timestamp_accel, timestamp);
 	/* Convert delta time to 3 bytes */
-	uint8_t delta_time_h = delta_time >> 16;
-	uint8_t delta_time_m = delta_time >> 8;
-	uint8_t delta_time_l = delta_time;
-	/* Get accelerometer sample data (which also clears the accel interrupt flag) */
-	uint8_t accel_x_axis_h = read_addr_accel(ACCEL_OUTX_H);
-	uint8_t accel_x_axis_l = read_addr_accel(ACCEL_OUTX_L);
-	uint8_t accel_y_axis_h = read_addr_accel(ACCEL_OUTY_H);
-	uint8_t accel_y_axis_l = read_addr_accel(ACCEL_OUTY_L);
-	uint8_t accel_z_axis_h = read_addr_accel(ACCEL_OUTZ_H);
-	uint8_t accel_z_axis_l = read_addr_accel(ACCEL_OUTZ_L);
-	/* Get gyroscope sample data */
-	uint8_t gyro_x_axis_h = 0;
-	uint8_t gyro_x_axis_l = 0;
-	uint8_t gyro_y_axis_h = 0;
-	uint8_t gyro_y_axis_l = 0;
-	uint8_t gyro_z_axis_h = 0;
-	uint8_t gyro_z_axis_l = 0;
-	if (gyroscope.is_enabled) {
-		gyro_x_axis_h = read_addr_gyro(GYRO_OUTX_H);
-		gyro_x_axis_l = read_addr_gyro(GYRO_OUTX_L);
-		gyro_y_axis_h = read_addr_gyro(GYRO_OUTY_H);
-		gyro_y_axis_l = read_addr_gyro(GYRO_OUTY_L);
-		gyro_z_axis_h = read_addr_gyro(GYRO_OUTZ_H);
-		gyro_z_axis_l = read_addr_gyro(GYRO_OUTZ_L);
-	}
-	/* Put the sample data in the buffer */
-	bool success = add_sample(&sample_buffer, delta_time_h, delta_time_m, delta_time_l,
-										accel_x_axis_h, accel_x_axis_l, accel_y_axis_h, accel_y_axis_l, accel_z_axis_h, accel_z_axis_l,
-										gyro_x_axis_h, gyro_x_axis_l, gyro_y_axis_h, gyro_y_axis_l, gyro_z_axis_h, gyro_z_axis_l);
-	if (success) {
+	uint8_t record[SAMPLE_RECORD_MAX];
+	record[0] = delta_time >> 16;
+	record[1] = delta_time >> 8;
+	record[2] = delta_time;
+	/* Get the sample data of the loggers in use (which also clears the accel interrupt flag) */
+	read_logger_axes(&record[SAMPLE_DT_SIZE]);
+	/* Put the sample record in the buffer */
+	uint8_t samples = add_decimated_sample(&sample_buffer, &decimator, record);
+	if (samples > 0) {
 		/* Update timestamp only if sample was successfully added to buffer */
 		timestamp_accel = timestamp;
+		/* An averaged record's delta time covers several ticks */
+		if (sync_sampling.is_active && samples == 1) {
+			record_sync_ticks(delta_time);
+		}
 	} else {
 //#ifdef DEBUG
 //		++debug_int;
@@ -1323,83 +2731,201 @@ bool sample_event_handled(void) {
 	return true;
 }
 
-bool timer_interrupt_triggered(void) {
-	if (TA0CCTL0 & (CCIFG)) {
-		return true;
+void select_sample_reader(void) {
+	bool is_gyro_logged = gyro_is_in_samples();
+	uint8_t record_size = SAMPLE_DT_SIZE;
+	if (accelerometer.is_enabled) {
+		record_size += axes_size(accelerometer.axes);
 	}
-	return false;
+	if (is_gyro_logged) {
+		record_size += axes_size(gyroscope.axes);
+	}
+	if (accelerometer.is_enabled && is_gyro_logged) {
+		read_logger_axes = read_accel_gyro_axes;
+	} else if (accelerometer.is_enabled) {
+		read_logger_axes = read_accel_axes;
+	} else if (is_gyro_logged) {
+		read_logger_axes = read_gyro_axes;
+	} else {
+		read_logger_axes = read_no_axes;
+	}
+	/* Smaller records leave room for more samples */
+	uint16_t size = sizeof(samples);
+	if (gyro_stream.is_active) {
+		/* The gyroscope stream gets its own half */
+		size /= 2;
+		construct_sample_buffer(&gyro_buffer, &samples[size], size, SAMPLE_DT_SIZE + axes_size(gyroscope.axes));
+		gyro_stream.watermark = gyro_buffer.capacity / 4;
+	}
+	construct_sample_buffer(&sample_buffer, samples, size, record_size);
 }
 
-void clear_timer_interrupt(void) {
-	TA0CCTL0 &= ~(CCIFG);
+uint16_t decimation_watermark(const struct SampleBuffer *buffer) {
+	/* The SD card gate fills the buffer on purpose */
+	if (sd_gate.is_active) {
+		return 0;
+	}
+	return (uint32_t)buffer->capacity * decimation_percent / 100;
 }
 
-bool button_interrupt_triggered(void) {
-	if (P1IV == P1IV_P1IFG1) {
-		return true;
+uint8_t axes_size(uint8_t axes) {
+	uint8_t size = 0;
+	for (uint8_t k = 0; k < 3; ++k) {
+		if (axes & (1 << k)) {
+			size += 2;
+		}
 	}
-	return false;
+	return size;
+}
+
+bool gyro_is_in_samples(void) {
+	return gyroscope.is_enabled && !gyro_stream.is_active;
 }
 
-enum ButtonPress get_button_press(bool can_triple_tap) {
-	enum ButtonPress first_button_press = wait_for_button_release();
-	if (!can_triple_tap || first_button_press != BUTTON_TAP) {
-		return first_button_press;
+/* Each reader below is read_axes() specialized for its loggers */
+#pragma inline = forced
+void read_axes(uint8_t *axes, bool is_accel_logged, bool is_gyro_logged) {
+	if (is_accel_logged) {
+		/* Only the axes in use are read (the others are disabled in the accelerometer) */
+		for (uint8_t k = 0; k < 3; ++k) {
+			if (accelerometer.axes & (1 << k)) {
+				*axes++ = read_addr_accel(ACCEL_OUTX_H + 2 * k);
+				*axes++ = read_addr_accel(ACCEL_OUTX_L + 2 * k);
+			}
+		}
+	} else {
+		/* The accelerometer interrupt is only cleared once its axes are read */
+		accelerometer_empty_read();
 	}
-	/* Check for second tap of triple tap (2 of 3) */
-	rtc_restart();
-	uint8_t sec = RTCSEC;
-	/* User has a time window to initiate another button tap */
-	while (!ctrl_high() && sec < BUTTON_TIME_WINDOW) {
-		if (rtc_rdy()) {
-			sec = RTCSEC;
+	if (is_gyro_logged) {
+		read_gyro(axes);
+	}
+}
+
+void read_gyro(uint8_t *axes) {
+	/* Only the axes in use are read (the others are disabled in the gyroscope) */
+	for (uint8_t k = 0; k < 3; ++k) {
+		if (gyroscope.axes & (1 << k)) {
+			*axes++ = read_addr_gyro(GYRO_OUTX_H + 2 * k);
+			*axes++ = read_addr_gyro(GYRO_OUTX_L + 2 * k);
 		}
 	}
-	/* Button was not pressed again within the time window */
-	if (!ctrl_high()) {
-		return first_button_press;
+}
+
+void read_accel_axes(uint8_t *axes) {
+	read_axes(axes, true, false);
+}
+
+void read_gyro_axes(uint8_t *axes) {
+	read_axes(axes, false, true);
+}
+
+void read_accel_gyro_axes(uint8_t *axes) {
+	read_axes(axes, true, true);
+}
+
+void read_no_axes(uint8_t *axes) {
+	read_axes(axes, false, false);
+}
+
+bool gyro_sample_event_handled(void) {
+	uint32_t timestamp;
+	if (!sample_time(&timestamp)) {
+		return false;
 	}
-	enum ButtonPress second_button_press = wait_for_button_release();
-	if (second_button_press != BUTTON_TAP) {
-		return second_button_press;
+	uint32_t delta_time = sample_delta_time(timestamp_gyro, timestamp);
+	uint8_t record[SAMPLE_DT_SIZE + SAMPLE_AXES_SIZE];
+	record[0] = delta_time >> 16;
+	record[1] = delta_time >> 8;
+	record[2] = delta_time;
+	/* Reading the axes clears the gyroscope interrupt */
+	read_gyro(&record[SAMPLE_DT_SIZE]);
+	if (add_decimated_sample(&gyro_buffer, &gyro_decimator, record) > 0) {
+		/* Update timestamp only if sample was successfully added to buffer */
+		timestamp_gyro = timestamp;
 	}
-	/* Check for third tap of triple tap (3 of 3) */
-	rtc_restart();
-	sec = RTCSEC;
-	/* User has a time window to initiate another button tap */
-	while (!ctrl_high() && sec < BUTTON_TIME_WINDOW) {
-		if (rtc_rdy()) {
-			sec = RTCSEC;
-		}
+	return true;
+}
+
+uint8_t add_decimated_sample(struct SampleBuffer *buffer, struct Decimator *decimator, uint8_t *record) {
+	/* Average samples into fewer records while the buffer is backed up */
+	uint8_t samples = decimate_sample(decimator, buffer->count, record);
+	if (samples == 0) {
+		return 0;
 	}
-	/* Button was not pressed again within the time window */
-	if (!ctrl_high()) {
-		return second_button_press;
+	/* Mark the rate change before the first record at the new rate */
+	uint8_t marker[SAMPLE_RECORD_MAX];
+	if (rate_marker(decimator, marker) && add_sample(buffer, marker)) {
+		rate_marker_added(decimator);
 	}
-	enum ButtonPress third_button_press = wait_for_button_release();
-	/* Triple tap achieved! */
-	if (third_button_press == BUTTON_TAP) {
-		return BUTTON_TRIPLE_TAP;
+	if (!add_sample(buffer, record)) {
+		return 0;
 	}
-	return third_button_press;
+	return samples;
 }
 
-enum ButtonPress wait_for_button_release(void) {
-	/* Wait for debouncing */
-	for (uint16_t debounce = BUTTON_DEBOUNCE_TIME; debounce; --debounce);
-	/* Wait until button is released or hold time is met */
-	rtc_restart();
-	uint8_t sec = RTCSEC;
-	while (ctrl_high() && sec < BUTTON_HOLD_TIME) {
-		feed_watchdog();
-		/* Get time when RTC is ready */
-		if (rtc_rdy()) {
-			sec = RTCSEC;
+uint32_t get_time(void) {
+	uint32_t timestamp;
+	uint16_t overflows;
+	read_timer(&timestamp, &overflows);
+	return timestamp;
+}
+
+void read_timer(uint32_t *timestamp, uint16_t *overflows) {
+	__istate_t state = __get_interrupt_state();
+	__disable_interrupt();
+	uint8_t high = time_cont;
+	uint16_t low = TA0R;
+	*overflows = time_overflows;
+	/* The timer wrapped before it was read but the interrupt hasn't counted it yet */
+	if (timer_interrupt_triggered() && low < 0x8000) {
+		if (++high == 0) {
+			++*overflows;
+		}
+	}
+	__set_interrupt_state(state);
+	*timestamp = ((uint32_t)high << 16) | low;
+}
+
+uint32_t get_long_time(void) {
+	uint32_t timestamp;
+	uint16_t overflows;
+	read_timer(&timestamp, &overflows);
+	return ((uint32_t)overflows << 24) | timestamp;
+}
+
+void timer_delay(uint32_t ticks) {
+	__istate_t state = __get_interrupt_state();
+	while (ticks > 0) {
+		uint16_t step = (ticks > 0xFFFF) ? 0xFFFF : ticks;
+		ticks -= step;
+		__disable_interrupt();
+		timer_delay_done = false;
+		TA0CCR1 = TA0R + step;
+		TA0CCTL1 = CCIE;
+		/* SMCLK keeps the timer running in LPM0; other interrupts may wake us early */
+		while (!timer_delay_done) {
+			__bis_SR_register(LPM0_bits | GIE);
+			__disable_interrupt();
 		}
 	}
-	/* Button held */
-	if (sec >= BUTTON_HOLD_TIME) {
-		return BUTTON_HOLD;
+	__set_interrupt_state(state);
+}
+
+bool timer_interrupt_triggered(void) {
+	if (TA0CCTL0 & (CCIFG)) {
+		return true;
+	}
+	return false;
+}
+
+void clear_timer_interrupt(void) {
+	TA0CCTL0 &= ~(CCIFG);
+}
+
+bool button_interrupt_triggered(void) {
+	if (P1IV == P1IV_P1IFG1) {
+		return true;
 	}
-	return BUTTON_TAP;
+	return false;
 }
\ No newline at end of file
@@ -79,10 +79,22 @@ uint16_t adc_read(void) {
 	return ADC10MEM0;
 }
 
+/*----------------------------------------------------------------------------*/
+/* Start reading voltage with ADC (10 bit) and interrupt when the result is	  */
+/* ready in ADC10MEM0														  */
+/*----------------------------------------------------------------------------*/
+void adc_start(void) {
+	ADC10IFG = 0x0000;							// Clear interrupt flags
+	ADC10IE |= ADC10IE0;						// Interrupt when ready
+	ADC10CTL0 &= ~ADC10ENC;						// Disable ADC
+	ADC10CTL0 |= ADC10ENC | ADC10SC;			// Enable and read once
+}
+
 /*----------------------------------------------------------------------------*/
 /* Set up and configure clock												  */
 /*----------------------------------------------------------------------------*/
 void clock_config(void) {
+	vcore_set(VCORE_NORMAL);	// Core voltage for 12 MHz
 // Set DCO range to 4.6 - 39.0 MHz
 	UCSCTL1 = DCORSEL1 | DCORSEL2;
 // Set DCOCLKDIV to (32768 kHz / 1) * 366 =~ 12 MHz
@@ -99,6 +111,88 @@ void clock_config(void) {
 //	UCSCTL6 &= (~BIT2);
 }
 
+/*----------------------------------------------------------------------------*/
+/* Start XT1 (32768 Hz crystal on P5.4/P5.5, see mcu_xt_pins()) and lock the  */
+/* FLL to it instead of REFO. Return 1 if it started, 0 if it didn't (the	  */
+/* FLL stays on REFO).														  */
+/*----------------------------------------------------------------------------*/
+uint8_t xt1_start(void) {
+	UCSCTL6 &= ~(XT1OFF | XTS);			// XT1 on, low frequency mode
+	UCSCTL6 |= XCAP_3;					// Internal load capacitance
+// Wait up to about 1 s for the crystal to start
+	for (uint32_t i = XT1_START_POLLS; i; --i) {
+		UCSCTL7 &= ~(XT2OFFG | XT1LFOFFG | DCOFFG);	// Clear fault flags
+		SFRIFG1 &= ~OFIFG;
+		if (!(UCSCTL7 & XT1LFOFFG)) {
+			UCSCTL3 = SELREF__XT1CLK;	// FLL reference = XT1
+			return 1;
+		}
+	}
+	UCSCTL6 |= XT1OFF;					// XT1 off
+	return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Raise the core voltage one level. The high-side and low-side supervisors	  */
+/* are moved up first so the core is not reset while the voltage rises.		  */
+/*----------------------------------------------------------------------------*/
+void vcore_up(uint8_t level) {
+	PMMCTL0_H = PMMPW_H;		// Open PMM
+// Set SVS/SVM high side to the new level
+	SVSMHCTL = SVSHE | SVSHRVL0 * level | SVMHE | SVSMHRRL0 * level;
+// Set SVM low side to the new level
+	SVSMLCTL = SVSLE | SVMLE | SVSMLRRL0 * level;
+	while ((PMMIFG & SVSMLDLYIFG) == 0);	// Wait until SVM is settled
+	PMMIFG &= ~(SVMLVLRIFG | SVMLIFG);		// Clear already set flags
+	PMMCTL0_L = PMMCOREV0 * level;			// Set VCore to the new level
+	if (PMMIFG & SVMLIFG) {
+		while ((PMMIFG & SVMLVLRIFG) == 0);	// Wait until the level is reached
+	}
+// Set SVS/SVM low side to the new level
+	SVSMLCTL = SVSLE | SVSLRVL0 * level | SVMLE | SVSMLRRL0 * level;
+	PMMCTL0_H = 0x00;			// Close PMM
+}
+
+/*----------------------------------------------------------------------------*/
+/* Lower the core voltage one level											  */
+/*----------------------------------------------------------------------------*/
+void vcore_down(uint8_t level) {
+	PMMCTL0_H = PMMPW_H;		// Open PMM
+// Set SVS/SVM low side to the new level
+	SVSMLCTL = SVSLE | SVSLRVL0 * level | SVMLE | SVSMLRRL0 * level;
+	while ((PMMIFG & SVSMLDLYIFG) == 0);	// Wait until SVM is settled
+	PMMCTL0_L = PMMCOREV0 * level;			// Set VCore to the new level
+	PMMCTL0_H = 0x00;			// Close PMM
+}
+
+/*----------------------------------------------------------------------------*/
+/* Step the core voltage to level (0-3)										  */
+/*----------------------------------------------------------------------------*/
+void vcore_set(uint8_t level) {
+	uint8_t now = PMMCTL0_L & PMMCOREV_3;
+	while (now < level) {
+		vcore_up(++now);
+	}
+	while (now > level) {
+		vcore_down(--now);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/* Run MCLK from DCOCLK (24 MHz). SMCLK stays at 12 MHz. The core voltage	  */
+/* must be VCORE_FAST.														  */
+/*----------------------------------------------------------------------------*/
+void mclk_fast(void) {
+	UCSCTL4 = SELA__REFOCLK | SELS__DCOCLKDIV | SELM__DCOCLK;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Run MCLK from DCOCLKDIV (12 MHz) like SMCLK								  */
+/*----------------------------------------------------------------------------*/
+void mclk_normal(void) {
+	UCSCTL4 = SELA__REFOCLK | SELS__DCOCLKDIV | SELM__DCOCLKDIV;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Restart Real-Time Clock A in calendar mode								  */
 /*----------------------------------------------------------------------------*/
@@ -109,6 +203,20 @@ registers */
 	RTCCTL01 = RTCMODE;			// Calendar mode
 }
 
+/*----------------------------------------------------------------------------*/
+/* Interrupt twice per second from RTC prescaler 1 (128 Hz / 64)			  */
+/*----------------------------------------------------------------------------*/
+void rtc_tick_on(void) {
+	RTCPS1CTL = RT1IP_5 | RT1PSIE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Stop the RTC prescaler 1 interrupt										  */
+/*----------------------------------------------------------------------------*/
+void rtc_tick_off(void) {
+	RTCPS1CTL = 0;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Return true iff RTC time values are safe for reading (not in transition)	  */
 /*----------------------------------------------------------------------------*/
@@ -137,6 +245,89 @@ void brownout_reset(void) {
 	PMMCTL0 = PMMPW | PMMSWBOR;
 }
 
+/*----------------------------------------------------------------------------*/
+/* Set up Timer1_A3 to count continuously from ACLK (1/32768 s per tick)	  */
+/*----------------------------------------------------------------------------*/
+void timer1_config(void) {
+// ACLK source, f/1, count continuously, Timer_A clear
+	TA1CTL = TASSEL_1 | ID_0 | MC_2 | TACLR;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Return the count of Timer1_A3. ACLK is asynchronous to MCLK, so read		  */
+/* until the count is stable.												  */
+/*----------------------------------------------------------------------------*/
+uint16_t timer1_read(void) {
+	uint16_t count = TA1R;
+	uint16_t prev;
+	do {
+		prev = count;
+		count = TA1R;
+	} while (count != prev);
+	return count;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Interrupt on Timer1_A3 CCR0 after ticks									  */
+/*----------------------------------------------------------------------------*/
+void timer1_ccr0_start(uint16_t ticks) {
+	TA1CCR0 = timer1_read() + ticks;
+	TA1CCTL0 = CCIE;			// Enable interrupt for CCR0
+}
+
+/*----------------------------------------------------------------------------*/
+/* Stop interrupting on Timer1_A3 CCR0										  */
+/*----------------------------------------------------------------------------*/
+void timer1_ccr0_stop(void) {
+	TA1CCTL0 = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Interrupt on Timer1_A3 CCR1 after ticks									  */
+/*----------------------------------------------------------------------------*/
+void timer1_ccr1_start(uint16_t ticks) {
+	TA1CCR1 = timer1_read() + ticks;
+	TA1CCTL1 = CCIE;			// Enable interrupt for CCR1
+}
+
+/*----------------------------------------------------------------------------*/
+/* Interrupt on Timer1_A3 CCR1 again, ticks after the last interrupt		  */
+/*----------------------------------------------------------------------------*/
+void timer1_ccr1_next(uint16_t ticks) {
+	TA1CCR1 += ticks;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Stop interrupting on Timer1_A3 CCR1										  */
+/*----------------------------------------------------------------------------*/
+void timer1_ccr1_stop(void) {
+	TA1CCTL1 = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Start Timer2_A3 from SMCLK, interrupting on CCR0 every ticks. The input	  */
+/* divider is the smallest that fits ticks in 16 bits, so ticks must be a	  */
+/* multiple of it to keep the period exact.									  */
+/*----------------------------------------------------------------------------*/
+void timer2_start(uint32_t ticks) {
+	uint8_t shift = 0;
+	while ((ticks >> shift) > 0x10000 && shift < 3) {
+		++shift;
+	}
+	TA2CCR0 = (ticks >> shift) - 1;	// Count up to ticks / 2^shift - 1
+	TA2CCTL0 = CCIE;				// Enable interrupt for CCR0
+// SMCLK source, f/2^shift, count up to CCR0, Timer_A clear
+	TA2CTL = TASSEL_2 | (ID0 * shift) | MC_1 | TACLR;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Stop Timer2_A3															  */
+/*----------------------------------------------------------------------------*/
+void timer2_stop(void) {
+	TA2CTL = 0;
+	TA2CCTL0 = 0;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Set up Timer0_A5															  */
 /*----------------------------------------------------------------------------*/
@@ -147,4 +338,28 @@ void timer_config(void) {
 	TA0CTL = TASSEL_2 | ID_0 | MC_1 | TACLR;
 }
 
+/*----------------------------------------------------------------------------*/
+/* Erase the information memory segments (128 bytes each) starting at dest	  */
+/* that count bytes cover, then write count bytes from src to dest.		  */
+/* dest must be at the start of a segment other than segment A.			  */
+/*----------------------------------------------------------------------------*/
+void info_flash_write(uint8_t *dest, const uint8_t *src, uint16_t count) {
+	__istate_t state = __get_interrupt_state();
+	__disable_interrupt();
+	FCTL3 = FWKEY;								// Clear LOCK
+	for (uint16_t i = 0; i < count; i += INFO_SEGMENT_SIZE) {
+		FCTL1 = FWKEY | ERASE;					// Segment erase
+		dest[i] = 0;							// Dummy write starts the erase
+		while (FCTL3 & BUSY);
+	}
+	FCTL1 = FWKEY | WRT;						// Byte write
+	for (uint16_t i = 0; i < count; ++i) {
+		dest[i] = src[i];
+		while (FCTL3 & BUSY);
+	}
+	FCTL1 = FWKEY;								// Clear WRT
+	FCTL3 = FWKEY | LOCK;						// Set LOCK
+	__set_interrupt_state(state);
+}
+
 #endif
\ No newline at end of file
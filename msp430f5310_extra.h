@@ -8,18 +8,48 @@
 /* Threshold voltage for device operation = 3.0 V */
 #define VOLTAGE_THRSHLD		0x0267
 
+/* Rise above VOLTAGE_THRSHLD (in ADC counts, ~80 mV) before the voltage is no longer low */
+#define VOLTAGE_HYSTERESIS	0x0010
+
+/* Core voltage levels for MCLK up to 12 MHz and up to 25 MHz */
+#define VCORE_NORMAL	1
+#define VCORE_FAST		3
+
+/* Polls of the XT1 fault flag before giving up on the crystal */
+#define XT1_START_POLLS	500000UL
+
+/* Size of an information memory segment in bytes */
+#define INFO_SEGMENT_SIZE	128
+
 void enter_LPM(void);
 void exit_LPM(void);
 void wdt_config(void);
 void wdt_stop(void);
 void adc_config(void);
 uint16_t adc_read(void);
+void adc_start(void);
 void clock_config(void);
+uint8_t xt1_start(void);
+void vcore_set(uint8_t level);
+void mclk_fast(void);
+void mclk_normal(void);
 void rtc_restart(void);
+void rtc_tick_on(void);
+void rtc_tick_off(void);
 uint8_t rtc_rdy(void);
 void enable_interrupts(void);
 void disable_interrupts(void);
 void brownout_reset(void);
 void timer_config(void);
+void timer1_config(void);
+void timer2_start(uint32_t ticks);
+void timer2_stop(void);
+uint16_t timer1_read(void);
+void timer1_ccr0_start(uint16_t ticks);
+void timer1_ccr0_stop(void);
+void timer1_ccr1_start(uint16_t ticks);
+void timer1_ccr1_next(uint16_t ticks);
+void timer1_ccr1_stop(void);
+void info_flash_write(uint8_t *dest, const uint8_t *src, uint16_t count);
 
 #endif
\ No newline at end of file
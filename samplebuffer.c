@@ -4,115 +4,63 @@
 
 #include "samplebuffer.h"
 
-/* 
- * Set the sample's dt and loggers' axes to 0.
- *
- * sample: The sample to be cleared
- */
-void clear_sample(volatile struct Sample *sample);
-
-void construct_sample_buffer(struct SampleBuffer *sample_buffer, volatile struct Sample *samples, uint16_t size) {
-	sample_buffer->samples = samples;
+void construct_sample_buffer(struct SampleBuffer *sample_buffer, volatile uint8_t *records, uint16_t size, uint8_t record_size) {
+	sample_buffer->records = records;
 	sample_buffer->size = size;
-	sample_buffer->start = 0;
-	sample_buffer->end = 0;
-	sample_buffer->count = 0;
+	set_sample_record_size(sample_buffer, record_size);
+}
+
+void set_sample_record_size(struct SampleBuffer *sample_buffer, uint8_t record_size) {
+	sample_buffer->record_size = record_size;
+	sample_buffer->capacity = sample_buffer->size / record_size;
+	clear_sample_buffer(sample_buffer);
 }
 
 void clear_sample_buffer(struct SampleBuffer *sample_buffer) {
 	for (uint16_t i = 0; i < sample_buffer->size; ++i) {
-		volatile struct Sample *sample = &sample_buffer->samples[i];
-		clear_sample(sample);
+		sample_buffer->records[i] = 0;
 	}
 	sample_buffer->start = 0;
 	sample_buffer->end = 0;
 	sample_buffer->count = 0;
 }
 
-bool add_sample(struct SampleBuffer *sample_buffer, uint8_t delta_time_h, uint8_t delta_time_m, uint8_t delta_time_l,
-						uint8_t accel_x_axis_h, uint8_t accel_x_axis_l, uint8_t accel_y_axis_h, uint8_t accel_y_axis_l, uint8_t accel_z_axis_h, uint8_t accel_z_axis_l,
-						uint8_t gyro_x_axis_h, uint8_t gyro_x_axis_l, uint8_t gyro_y_axis_h, uint8_t gyro_y_axis_l, uint8_t gyro_z_axis_h, uint8_t gyro_z_axis_l) {
+bool add_sample(struct SampleBuffer *sample_buffer, const uint8_t *record) {
 	/* The buffer is full */
-	if (sample_buffer->count == sample_buffer->size) {
+	if (sample_buffer->count == sample_buffer->capacity) {
 		return false;
 	}
-	/* Set data for new sample based on parameters */
-	volatile struct Sample *sample = &sample_buffer->samples[sample_buffer->end];
-	/* Delta time */
-	sample->delta_time[0] = delta_time_h;
-	sample->delta_time[1] = delta_time_m;
-	sample->delta_time[2] = delta_time_l;
-	/* From accelerometer */
-	sample->accel.x_axis[0] = accel_x_axis_h;
-	sample->accel.x_axis[1] = accel_x_axis_l;
-	sample->accel.y_axis[0] = accel_y_axis_h;
-	sample->accel.y_axis[1] = accel_y_axis_l;
-	sample->accel.z_axis[0] = accel_z_axis_h;
-	sample->accel.z_axis[1] = accel_z_axis_l;
-	/* From gyroscope */
-	sample->gyro.x_axis[0] = gyro_x_axis_h;
-	sample->gyro.x_axis[1] = gyro_x_axis_l;
-	sample->gyro.y_axis[0] = gyro_y_axis_h;
-	sample->gyro.y_axis[1] = gyro_y_axis_l;
-	sample->gyro.z_axis[0] = gyro_z_axis_h;
-	sample->gyro.z_axis[1] = gyro_z_axis_l;
-	/* Increment the index for the next sample */
-	sample_buffer->end = (sample_buffer->end + 1) % sample_buffer->size;
+	volatile uint8_t *sample = &sample_buffer->records[sample_buffer->end];
+	for (uint8_t i = 0; i < sample_buffer->record_size; ++i) {
+		sample[i] = record[i];
+	}
+	/* Increment the index for the next record */
+	sample_buffer->end += sample_buffer->record_size;
+	if (sample_buffer->end == sample_buffer->capacity * sample_buffer->record_size) {
+		sample_buffer->end = 0;
+	}
 	++sample_buffer->count;
 	return true;
 }
 
-bool remove_sample(struct SampleBuffer *sample_buffer, struct Sample *sample_ret) {
+bool remove_sample(struct SampleBuffer *sample_buffer, uint8_t *record_ret) {
 	/* The buffer is empty */
 	if (sample_buffer->count == 0) {
 		return false;
 	}
 	/*
-	 * Store the sample in a new variable so the data won't be overwritten by a new sample when read 
-	 * instead of returning the existing sample in the buffer
+	 * Copy the record so the data won't be overwritten by a new sample when read 
+	 * instead of returning the existing record in the buffer
 	 */
-	volatile struct Sample *sample = &sample_buffer->samples[sample_buffer->start];
-	/* Delta time */
-	sample_ret->delta_time[0] = sample->delta_time[0];
-	sample_ret->delta_time[1] = sample->delta_time[1];
-	sample_ret->delta_time[2] = sample->delta_time[2];
-	/* From accelerometer */
-	sample_ret->accel.x_axis[0] = sample->accel.x_axis[0];
-	sample_ret->accel.x_axis[1] = sample->accel.x_axis[1];
-	sample_ret->accel.y_axis[0] = sample->accel.y_axis[0];
-	sample_ret->accel.y_axis[1] = sample->accel.y_axis[1];
-	sample_ret->accel.z_axis[0] = sample->accel.z_axis[0];
-	sample_ret->accel.z_axis[1] = sample->accel.z_axis[1];
-	/* From gyroscope */
-	sample_ret->gyro.x_axis[0] = sample->gyro.x_axis[0];
-	sample_ret->gyro.x_axis[1] = sample->gyro.x_axis[1];
-	sample_ret->gyro.y_axis[0] = sample->gyro.y_axis[0];
-	sample_ret->gyro.y_axis[1] = sample->gyro.y_axis[1];
-	sample_ret->gyro.z_axis[0] = sample->gyro.z_axis[0];
-	sample_ret->gyro.z_axis[1] = sample->gyro.z_axis[1];
-	/* Set next sample to be removed as next sample in buffer */
-	sample_buffer->start = (sample_buffer->start + 1) % sample_buffer->size;
+	volatile uint8_t *sample = &sample_buffer->records[sample_buffer->start];
+	for (uint8_t i = 0; i < sample_buffer->record_size; ++i) {
+		record_ret[i] = sample[i];
+	}
+	/* Set next record to be removed as next record in buffer */
+	sample_buffer->start += sample_buffer->record_size;
+	if (sample_buffer->start == sample_buffer->capacity * sample_buffer->record_size) {
+		sample_buffer->start = 0;
+	}
 	--sample_buffer->count;
 	return true;
 }
-
-void clear_sample(volatile struct Sample *sample) {
-	/* Delta time */
-	sample->delta_time[0] = 0;
-	sample->delta_time[1] = 0;
-	sample->delta_time[2] = 0;
-	/* From accelerometer */
-	sample->accel.x_axis[0] = 0;
-	sample->accel.x_axis[1] = 0;
-	sample->accel.y_axis[0] = 0;
-	sample->accel.y_axis[1] = 0;
-	sample->accel.z_axis[0] = 0;
-	sample->accel.z_axis[1] = 0;
-	/* From gyroscope */
-	sample->gyro.x_axis[0] = 0;
-	sample->gyro.x_axis[1] = 0;
-	sample->gyro.y_axis[0] = 0;
-	sample->gyro.y_axis[1] = 0;
-	sample->gyro.z_axis[0] = 0;
-	sample->gyro.z_axis[1] = 0;
-}
\ No newline at end of file
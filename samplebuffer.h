@@ -8,65 +8,63 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-/* Hold the logger's sample axes */
-struct LoggerSample {
-	uint8_t x_axis[2];
-	uint8_t y_axis[2];
-	uint8_t z_axis[2];
-};
-
-/* Hold the loggers' sample data */
-struct Sample {
-	uint8_t delta_time[3];
-	struct LoggerSample accel;
-	struct LoggerSample gyro;
-};
-
-/* Circular buffer that holds the samples */
+/*
+ * Circular buffer that holds sample records of record_size bytes. Only as
+ * many whole records as fit are used, so a record never wraps around.
+ */
 struct SampleBuffer {
-	volatile struct Sample *samples;
+	volatile uint8_t *records;
 	uint16_t size;
+	uint8_t record_size;
+	uint16_t capacity;
 	uint16_t start;
 	uint16_t end;
 	volatile uint16_t count;
 };
 
 /* 
- * Set up a new sample buffer using the provided samples.
+ * Set up a new sample buffer using the provided bytes.
  * 
- * sample_buffer: the buffer for holding the specified samples.
+ * sample_buffer: the buffer for holding sample records.
  *
- * samples: the samples to insert into the specified sample_buffer.
+ * records: the bytes to hold the records in.
  *
- * size: the number of samples to be inserted.
+ * size: the number of bytes.
+ *
+ * record_size: the number of bytes in a record.
+ */
+void construct_sample_buffer(struct SampleBuffer *sample_buffer, volatile uint8_t *records, uint16_t size, uint8_t record_size);
+
+/* 
+ * Change the size of the records in the buffer and clear it.
+ * 
+ * record_size: the number of bytes in a record.
  */
-void construct_sample_buffer(struct SampleBuffer *sample_buffer, volatile struct Sample *samples, uint16_t size);
+void set_sample_record_size(struct SampleBuffer *sample_buffer, uint8_t record_size);
 
 /* 
- * Set all samples in the buffer to default values.
+ * Set all records in the buffer to default values.
  * 
- * sample_buffer: the buffer for which the samples inside will be cleared
+ * sample_buffer: the buffer for which the records inside will be cleared
  */
 void clear_sample_buffer(struct SampleBuffer *sample_buffer);
 
 /* 
- * Insert a new sample into the buffer.
+ * Insert a new record into the buffer.
  * 
- * PARAMS TODO
+ * record: record_size bytes to copy into the buffer
  *
  * Return true if the insertion was successful, false if not
  */
-bool add_sample(struct SampleBuffer *sample_buffer, uint8_t delta_time_h, uint8_t delta_time_m, uint8_t delta_time_l,
-						uint8_t accel_x_axis_h, uint8_t accel_x_axis_l, uint8_t accel_y_axis_h, uint8_t accel_y_axis_l, uint8_t accel_z_axis_h, uint8_t accel_z_axis_l,
-						uint8_t gyro_x_axis_h, uint8_t gyro_x_axis_l, uint8_t gyro_y_axis_h, uint8_t gyro_y_axis_l, uint8_t gyro_z_axis_h, uint8_t gyro_z_axis_l);
+bool add_sample(struct SampleBuffer *sample_buffer, const uint8_t *record);
 
 /* 
- * Retrieve and removes the oldest sample from the buffer.
+ * Retrieve and removes the oldest record from the buffer.
  * 
- * PARAMS TODO
+ * record_ret: gets a copy of the record (record_size bytes)
  *
  * Return true if the retrieval was successful, false if not
  */
-bool remove_sample(struct SampleBuffer *sample_buffer, struct Sample *sample_ret);
+bool remove_sample(struct SampleBuffer *sample_buffer, uint8_t *record_ret);
 
-#endif
\ No newline at end of file
+#endif
@@ -32,6 +32,7 @@
 
 #include <msp430f5310.h>
 #include <stdint.h>
+#include <stddef.h>
 #include "spi.h"
 #include "circuit.h"
 #include "sdfat.h"
@@ -43,6 +44,113 @@
  */
 uint32_t file_name_match_end(const uint8_t *file_name, const uint8_t *string, uint32_t offset);
 
+/*
+ * Return the 3 digit file number suffix of the directory table entry at offset
+ * if its name starts with file_name. Otherwise, return 0.
+ */
+uint16_t dir_entry_file_num(const uint8_t *file_name, const uint8_t *data, uint32_t offset);
+
+/*
+ * Return true iff the directory table entry at offset is the CONFIG.INI file.
+ */
+uint8_t is_config_entry(const uint8_t *data, uint32_t offset);
+
+/*
+ * Return the word at index i of a scratch buffer of little-endian words
+ */
+uint16_t scratch_word(const uint8_t *scratch, uint16_t i);
+
+/*
+ * Set the word at index i of a scratch buffer of little-endian words
+ */
+void set_scratch_word(uint8_t *scratch, uint16_t i, uint16_t w);
+
+/*
+ * Return true iff w is one of the first n words in scratch (sorted ascending)
+ */
+uint8_t scratch_has_word(const uint8_t *scratch, uint16_t n, uint16_t w);
+
+/*
+ * Return the size of the data in the last cluster of a recovered chain:
+ * stop at the first block that was never written (starts with 0x00 or 0xFF)
+ * or at the padding of the last block written (first 0x00).
+ */
+uint32_t tail_cluster_size(uint8_t *data, struct fatstruct *info, uint16_t cluster);
+
+/*
+ * Write the sector in a cache slot back to the SD card (to each FAT if it is a
+ * FAT sector)
+ */
+uint8_t write_back_slot(struct fatstruct *info, uint8_t slot);
+
+/*
+ * Return true iff the sector at offset is in one of the FATs
+ */
+uint8_t is_fat_sector(const struct fatstruct *info, uint32_t offset);
+
+/*
+ * Claim a cluster for the file, reclaiming the oldest data if the SD card is
+ * full and the file is in ring mode. Return 0 if there is no free cluster.
+ */
+uint16_t next_file_cluster(struct sdfile *file);
+
+/*
+ * Write the file's directory table entry
+ */
+uint8_t write_file_entry(struct sdfile *file);
+
+/*
+ * CRC7 of a command (with the end bit set), computed in software since it only
+ * covers 5 bytes
+ */
+uint8_t crc7(const uint8_t *bytes, uint8_t count);
+
+/*
+ * Send a data block (padded with zeros after count bytes) and its CRC16, then
+ * return the card's data response
+ */
+uint8_t send_data_block(uint8_t token, const uint8_t *data, uint16_t count);
+
+/*
+ * Write blocks from data at start_offset, starting from block *sent and
+ * counting the blocks the card accepts in *sent. Return SD_BAD_CRC after
+ * stopping the transmission if the card rejects a block for a bad CRC.
+ */
+uint8_t write_multiple_block_from(uint8_t *data, uint32_t start_offset, uint8_t blocks, uint8_t *sent);
+
+/*
+ * Finish the writer's write with err, recording its latency
+ */
+void end_write(struct sdwriter *writer, uint8_t err);
+
+/*
+ * Collect the writer's finished write for the file that owns it and move the
+ * file to a new cluster if the current one is full
+ */
+uint8_t end_file_write(struct sdfile *file);
+
+/*
+ * Advance the background write and start writing the file's queued blocks
+ * once there are at least min_blocks of them
+ */
+uint8_t advance_file(struct sdfile *file, uint8_t min_blocks);
+
+/*
+ * Start writing the file's queued blocks that are consecutive in both the
+ * buffer and the cluster. Return FAT_DISK_FULL if a burst file's run is full.
+ */
+uint8_t start_file_write(struct sdfile *file);
+
+/*
+ * Queue each block of the buffer that has filled since the last call
+ */
+void queue_file_blocks(struct sdfile *file);
+
+/*
+ * Number of bytes in the buffer after the queued blocks
+ */
+uint16_t unqueued_bytes(const struct sdfile *file);
+
 /*
  * Initialize SD Card
  */
@@ -98,6 +206,12 @@ uint8_t init_sd(void) {
 	/* SD 2.0 (HC or not) */
 	enum SDCardType ct = (ocr[0] & BIT6) ? CT_SDHC : CT_SD2;
 
+	/*
+	 * Turn on CRC checking so the card rejects a block that was corrupted on
+	 * the way. A card that doesn't take the command still works without it.
+	 */
+	send_cmd_sd(CMD59, 1);
+
 	SD_DESELECT();
 
 	if (ct == CT_SD2) {	/* SD 2.0 */
@@ -113,6 +227,17 @@ uint8_t init_sd(void) {
 	return SD_BAD_TYPE;
 }
 
+uint8_t status_sd(void) {
+	SD_SELECT();
+
+	/* A card that lost power answers nothing in SPI mode */
+	uint8_t err = (send_cmd_sd(CMD13, 0) || spia_rec()) ? SD_BAD_TOKEN : SD_SUCCESS;
+
+	SD_DESELECT();
+
+	return err;
+}
+
 /*
  * Send command to enter idle state
  */
@@ -128,25 +253,20 @@ void go_idle_sd() {
  * Send command and return error code. Return zero for OK
  */
 uint8_t send_cmd_sd(SDcmd cmd, uint32_t arg) {
-	/* Send command */
-	spia_send(cmd | BIT6);
-	
-	/* Send argument */
-	for (int8_t s = 24; s >= 0; s -= 8) {
-		spia_send(arg >> s);
+	uint8_t frame[5] = { cmd | BIT6, DTOB_HH(arg), DTOB_HL(arg), DTOB_LH(arg), DTOB_LL(arg) };
+
+	/* Send command and argument */
+	for (uint8_t i = 0; i < 5; ++i) {
+		spia_send(frame[i]);
 	}
 	
-	/* Send CRC */
-	uint8_t crc = DUMMY;
-	/* Correct CRC for CMD0 with arg 0 */
-	if (cmd == CMD0) {
-		crc = 0x95;
-	}
-	/* Correct CRC for CMD8 with arg 0x1AA */
-	if (cmd == CMD8) {
-		crc = 0x87;
+	/* Send CRC (checked by the card once CRC mode is on) */
+	spia_send(crc7(frame, 5));
+	
+	/* Discard the stuff byte following CMD12 */
+	if (cmd == CMD12) {
+		spia_rec();
 	}
-	spia_send(crc);
 	
 	/* Wait for response */
 	uint8_t status;
@@ -166,11 +286,55 @@ uint8_t send_acmd_sd(SDcmd acmd, uint32_t arg) {
 	return send_cmd_sd(acmd, arg);
 }
 
+uint8_t crc7(const uint8_t *bytes, uint8_t count) {
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < count; ++i) {
+		uint8_t b = bytes[i];
+		for (uint8_t bit = 0; bit < 8; ++bit) {
+			crc <<= 1;
+			if ((b ^ crc) & 0x80) {
+				crc ^= 0x09;
+			}
+			b <<= 1;
+		}
+	}
+	return (crc << 1) | 1;
+}
+
+/*
+ * The CRC module computes the CRC16-CCITT the card expects when bytes are
+ * written to CRCDIRB (bit reversed) and the result is read from CRCINIRES. It
+ * takes a byte in a single cycle, so it keeps up with the SPI bus.
+ */
+uint8_t send_data_block(uint8_t token, const uint8_t *data, uint16_t count) {
+	spia_send(token);
+	CRCINIRES = 0;
+	uint16_t i;
+	for (i = 0; i < count; ++i) {
+		spia_send(data[i]);
+		CRCDIRB_L = data[i];
+	}
+	/* Padding to fill block */
+	for (; i < BLKSIZE; ++i) {
+		spia_send(0);
+		CRCDIRB_L = 0;
+	}
+	uint16_t crc = CRCINIRES;
+	spia_send(WTOB_H(crc));
+	spia_send(WTOB_L(crc));
+	return spia_rec() & SD_WRITE_BLK_MASK;
+}
+
 /*
- * Wait for the card
+ * Wait for the card, giving up after SD_BUSY_POLLS bytes
  */
-void wait_notbusy(void) {
-	while (spia_rec() != SD_NOT_BUSY);
+uint8_t wait_notbusy(void) {
+	for (uint32_t i = 0; i < SD_BUSY_POLLS; ++i) {
+		if (spia_rec() == SD_NOT_BUSY) {
+			return SD_SUCCESS;
+		}
+	}
+	return SD_TIMEOUT;
 }
 
 /*
@@ -200,44 +364,78 @@ uint8_t wait_startblock(enum SDTimeout timeout) {
  * beginning at start_offset.
  */
 uint8_t write_multiple_block(uint8_t *data, uint32_t start_offset, uint8_t blocks) {
+	uint8_t sent = 0;
+	uint8_t retries = 0;
+	uint8_t err;
+	/* Start again from a block the card rejected for a bad CRC */
+	for (;;) {
+		uint8_t prev_sent = sent;
+		err = write_multiple_block_from(data, start_offset, blocks, &sent);
+		if (sent != prev_sent) {
+			retries = 0;
+		}
+		if (err != SD_BAD_CRC || retries == SD_CRC_RETRIES) {
+			break;
+		}
+		++retries;
+	}
+	return err;
+}
+
+uint8_t write_multiple_block_from(uint8_t *data, uint32_t start_offset, uint8_t blocks, uint8_t *sent) {
 	SD_SELECT();
 
-	wait_notbusy();	/* Wait for card to be ready */
+	/* Wait for card to be ready */
+	uint8_t err;
+	if (err = wait_notbusy()) {
+		SD_DESELECT();
+		return err;
+	}
 
 	/* Send command to erase blocks */
-	uint8_t err;
-	if (err = send_acmd_sd(ACMD23, blocks)) {
+	if (err = send_acmd_sd(ACMD23, blocks - *sent)) {
 		SD_DESELECT();
 		return err;
 	}
 	
 	/* Send command to write blocks */
-	if (err = send_cmd_sd(CMD25, start_offset)) {
+	if (err = send_cmd_sd(CMD25, start_offset + (uint32_t)*sent * BLKSIZE)) {
 		SD_DESELECT();
 		return err;
 	}
 	
 	/* Write data buffer to blocks */
-	for (uint8_t i = 0; i < blocks; ++i) {
-		/* Send 'Start Block' token for each block */
-		spia_send(SD_MULTI_BLK);
-		
-		uint16_t block_offset = BLKSIZE * i;
-		for (uint16_t j = block_offset; j < block_offset + BLKSIZE; ++j) {
-			spia_send(data[j]);
+	for (; *sent < blocks; ++*sent) {
+		/* Send 'Start Block' token and the block */
+		uint8_t resp = send_data_block(SD_MULTI_BLK, data + (uint16_t)*sent * BLKSIZE, BLKSIZE);
+		if (resp != SD_WRITE_BLK) {
+			/* Stop the transmission before sending the rest again */
+			if (resp == SD_WRITE_CRC_ERR) {
+				spia_send(SD_STOP_TRANS);
+				spia_rec();
+				wait_notbusy();
+				SD_DESELECT();
+				return SD_BAD_CRC;
+			}
+			SD_DESELECT();
+			return SD_BAD_TOKEN;
 		}
 
-		spia_send(DUMMY);	/* Dummy CRC */
-		spia_send(DUMMY);	/* Dummy CRC */
-
-		wait_notbusy();	/* Wait for flash programming to complete */
+		/* Wait for flash programming to complete */
+		if (err = wait_notbusy()) {
+			SD_DESELECT();
+			return err;
+		}
 	}
 
 	/* Send 'Stop Tran' token (stop transmission) */
 	spia_send(SD_STOP_TRANS);
 	
 	/* Wait for flash programming to complete */
-	wait_notbusy();
+	if (err = wait_notbusy()) {
+		SD_DESELECT();
+		return err;
+	}
 
 	/* Get status */
 	if (err = send_cmd_sd(CMD13, 0) || spia_rec())	{
@@ -249,7 +447,6 @@ uint8_t write_multiple_block(uint8_t *data, uint32_t start_offset, uint8_t block
 
 	return SD_SUCCESS;
 }
-
 /*
  * Write the first count bytes in the given data buffer starting at offset
  */
@@ -261,36 +458,36 @@ uint8_t write_block(uint8_t *data, uint32_t offset, uint16_t count) {
 	
 	SD_SELECT();
 	
-	/* WRITE_BLOCK command */
-	uint8_t err = send_cmd_sd(CMD24, offset);
-	if (err) {
-		SD_DESELECT();
-		return err;
-	}
-	spia_send(SD_SINGLE_BLK);	/* Write Single Block token */
-	
-	/* Write data bytes */
-	{
-		uint16_t i;
-		for (i = 0; i < count; i++) {
-			spia_send(data[i]);
+	/* Send the block again if the card rejects it for a bad CRC */
+	uint8_t resp;
+	for (uint8_t retries = 0; ; ++retries) {
+		/* WRITE_BLOCK command */
+		uint8_t err = send_cmd_sd(CMD24, offset);
+		if (err) {
+			SD_DESELECT();
+			return err;
+		}
+		/* Write Single Block token and data bytes */
+		resp = send_data_block(SD_SINGLE_BLK, data, count);
+		if (resp != SD_WRITE_CRC_ERR || retries == SD_CRC_RETRIES) {
+			break;
 		}
-		/* Padding to fill block */
-		for (; i < BLKSIZE; i++) {
-			spia_send(0);
+		if (wait_notbusy()) {
+			SD_DESELECT();
+			return SD_TIMEOUT;
 		}
 	}
 	
-	spia_send(DUMMY);	/* Dummy CRC */
-	spia_send(DUMMY);	/* Dummy CRC */
-	
-	if ((spia_rec() & SD_WRITE_BLK_MASK) != SD_WRITE_BLK) {
+	if (resp != SD_WRITE_BLK) {
 		SD_DESELECT();
 		return SD_BAD_TOKEN;
 	}
 
 	/* Wait for flash programming to complete */
-	wait_notbusy();
+	if (wait_notbusy()) {
+		SD_DESELECT();
+		return SD_TIMEOUT;
+	}
 	
 	/* Get status */
 	if (send_cmd_sd(CMD13, 0) || spia_rec())	{
@@ -333,214 +530,604 @@ uint8_t read_block(uint8_t *data, uint32_t offset, enum SDTimeout timeout) {
 }
 
 /*
- * Find and return a free cluster for writing file contents (also writes to
- * FAT)
- * Start searching incrementally, starting at start_cluster.
- * Return free cluster index (>0).
- * Return 0 on error or if there are no more free clusters.
+ * Start reading consecutive blocks beginning at start_offset
+ * Follow with read_multiple_block_next() for each block and finish with
+ * read_multiple_block_stop().
  */
-uint16_t find_cluster(uint8_t *data, struct fatstruct *info) {
-	uint32_t block_offset = 0;
-	for (uint32_t i = 0; i < info->fatsize; i += 2) {
-		uint32_t j = i % BLKSIZE;	/* Cluster index relative to block */
-				
-		/* Read each new block of the FAT */
-		if (j == 0) {
-			block_offset = info->fatoffset + i;
-			if (read_block(data, block_offset, SD_LONG_TIMEOUT)) {
-				/* Couldn't read this block so skip it */
-				i += (BLKSIZE - 2);
-				continue;
-			}
-		}
-		
-		if (data[j] == 0x00 && data[j+1] == 0x00) {
-			
-			/* Set cluster to 0xFFFF to indicate end of cluster chain for current file
-			   (will be modified if file data continues) */
-			data[j] = 0xFF;
-			data[j+1] = 0xFF;
-
-			/* Write to FAT  */
-			if (write_block(data, block_offset, BLKSIZE)) {
-				return 0;
-			}
-
-			/* Write to second FAT  */
-			if (info->nfats > 1) {
-				if (write_block(data, block_offset + info->fatsize, BLKSIZE))
-					return 0;
-			}
-
-			/* Return free cluster index */
-			return i >> 1;
-		}
+uint8_t read_multiple_block_start(uint32_t start_offset) {
+	SD_SELECT();
+	
+	/* READ_MULTIPLE_BLOCK command with offset as argument */
+	uint8_t err = send_cmd_sd(CMD18, start_offset);
+	if (err) {
+		SD_DESELECT();
+		return err;
 	}
 	
-	/* Failed to find a free cluster (disk may be full) */
-	return 0;
+	return SD_SUCCESS;
 }
 
 /*
- * Return the offset of the given cluster number
+ * Read the next 512 bytes of a multiple block read into the given data buffer
  */
-uint32_t get_cluster_offset(uint16_t clust, struct fatstruct *info) {
-	return info->fileclustoffset + ((clust - 2) * info->nbytesinclust);
+uint8_t read_multiple_block_next(uint8_t *data, enum SDTimeout timeout) {
+	/* Wait for the start of the block */
+	if (wait_startblock(timeout)) {
+		return SD_TIMEOUT;
+	}
+	
+	/* Read bytes */
+	for (uint16_t i = 0; i < BLKSIZE; i++) {
+		data[i] = spia_rec();
+	}
+	
+	spia_rec();	/* Ignore CRC */
+	spia_rec();	/* Ignore CRC */
+	
+	return SD_SUCCESS;
 }
 
 /*
- * Return true if block number is less than nsectsinclust. Otherwise, return false.
+ * Stop a multiple block read
  */
-uint8_t valid_block(uint8_t block, struct fatstruct *info) {
-	return block < info->nsectsinclust;
+void read_multiple_block_stop(void) {
+	send_cmd_sd(CMD12, 0);
+	
+	wait_notbusy();
+	
+	SD_DESELECT();
+}
+
+void construct_writer(struct sdwriter *writer, uint32_t (*get_time)(void), uint32_t timeout) {
+	writer->state = SD_WRITE_IDLE;
+	writer->err = SD_SUCCESS;
+	writer->owner = 0;
+	writer->get_time = get_time;
+	writer->timeout = timeout;
+	for (uint8_t k = 0; k < SD_LATENCY_BUCKETS; ++k) {
+		writer->latency[k] = 0;
+	}
+	writer->timeouts = 0;
+	writer->crc_retries = 0;
+}
+
+void start_write(struct sdwriter *writer, struct sdfile *owner, uint8_t *data, uint32_t start_offset, uint8_t blocks) {
+	writer->owner = owner;
+	writer->data = data;
+	writer->offset = start_offset;
+	writer->blocks = blocks;
+	writer->sent = 0;
+	writer->retries = 0;
+	writer->restarts = 0;
+	writer->err = SD_SUCCESS;
+	writer->start = writer->get_time();
+	writer->restart = writer->start;
+	SD_SELECT();
+	writer->state = SD_WRITE_ISSUE;
 }
 
 /*
- * Update the FAT
- * Replace the cluster word at byte offset index with num.
+ * Each step either polls a single byte while the card is busy or does a piece
+ * of work that doesn't wait on the card: sending the commands or sending a
+ * block. The card stays selected between steps.
  */
-uint8_t update_fat(uint8_t *data, struct fatstruct *info, uint16_t index, uint16_t num) {
-	uint32_t block_offset = info->fatoffset + index - (index % BLKSIZE);
-	
-	/* Read the right block of the FAT  */
-	{
-		uint8_t err = read_block(data, block_offset, SD_LONG_TIMEOUT);
+uint8_t step_write(struct sdwriter *writer) {
+	switch (writer->state) {
+		case SD_WRITE_ISSUE:
+			/* Wait for card to be ready */
+			if (spia_rec() != SD_NOT_BUSY) {
+				break;
+			}
+			/* Send command to erase blocks, then command to write blocks */
+			{
+				uint8_t err = send_acmd_sd(ACMD23, writer->blocks - writer->sent);
+				if (!err) {
+					err = send_cmd_sd(CMD25, writer->offset + (uint32_t)writer->sent * BLKSIZE);
+				}
+				if (err) {
+					end_write(writer, err);
+					return writer->state;
+				}
+			}
+			writer->state = SD_WRITE_TRANSFER;
+			break;
+		case SD_WRITE_TRANSFER:
+			/* Send 'Start Block' token and the block */
+			{
+				const uint8_t *block = writer->data + (uint16_t)writer->sent * BLKSIZE;
+				uint8_t resp = send_data_block(SD_MULTI_BLK, block, BLKSIZE);
+				/* Stop the transmission and start again from the rejected block */
+				if (resp == SD_WRITE_CRC_ERR && writer->retries < SD_CRC_RETRIES) {
+					++writer->retries;
+					++writer->crc_retries;
+					spia_send(SD_STOP_TRANS);
+					spia_rec();	/* Skip the byte before the card goes busy */
+					writer->state = SD_WRITE_ISSUE;
+					break;
+				}
+				if (resp != SD_WRITE_BLK) {
+					end_write(writer, SD_BAD_TOKEN);
+					return writer->state;
+				}
+				++writer->sent;
+				writer->retries = 0;
+			}
+			writer->state = SD_WRITE_BUSY;
+			break;
+		case SD_WRITE_BUSY:
+			/* Wait for flash programming to complete */
+			if (spia_rec() != SD_NOT_BUSY) {
+				break;
+			}
+			if (writer->sent < writer->blocks) {
+				writer->state = SD_WRITE_TRANSFER;
+				break;
+			}
+			/* Send 'Stop Tran' token (stop transmission) */
+			spia_send(SD_STOP_TRANS);
+			spia_rec();	/* Skip the byte before the card goes busy */
+			writer->state = SD_WRITE_STOP;
+			break;
+		case SD_WRITE_STOP:
+			/* Wait for flash programming to complete */
+			if (spia_rec() != SD_NOT_BUSY) {
+				break;
+			}
+			/* Get status */
+			end_write(writer, (send_cmd_sd(CMD13, 0) || spia_rec()) ? SD_BAD_TOKEN : SD_SUCCESS);
+			return writer->state;
+		case SD_WRITE_RESTART:
+			/* Wait for flash programming to complete */
+			if (spia_rec() != SD_NOT_BUSY) {
+				break;
+			}
+			/* Stop the transmission and start again from the next block */
+			spia_send(SD_STOP_TRANS);
+			spia_rec();	/* Skip the byte before the card goes busy */
+			writer->state = SD_WRITE_ISSUE;
+			break;
+		default:
+			return writer->state;
+	}
+
+	/* Stop a write the card stays busy on and send the rest again */
+	if (((writer->get_time() - writer->restart) & SD_TIME_MASK) > writer->timeout) {
+		++writer->timeouts;
+		uint8_t in_write = writer->state == SD_WRITE_TRANSFER ||
+			writer->state == SD_WRITE_BUSY ||
+			writer->state == SD_WRITE_RESTART;
+		if (writer->restarts == SD_TIMEOUT_RETRIES) {
+			/* Give up, but leave the card ready for the next command */
+			if (in_write) {
+				wait_notbusy();
+				spia_send(SD_STOP_TRANS);
+				spia_rec();
+				wait_notbusy();
+			}
+			end_write(writer, SD_TIMEOUT);
+			return writer->state;
+		}
+		++writer->restarts;
+		writer->restart = writer->get_time();
+		if (writer->state == SD_WRITE_TRANSFER) {
+			spia_send(SD_STOP_TRANS);
+			spia_rec();	/* Skip the byte before the card goes busy */
+			writer->state = SD_WRITE_ISSUE;
+		} else if (writer->state == SD_WRITE_BUSY && writer->sent < writer->blocks) {
+			/* The card takes the 'Stop Tran' token once the block is programmed */
+			writer->state = SD_WRITE_RESTART;
+		}
+	}
+	return writer->state;
+}
+
+void end_write(struct sdwriter *writer, uint8_t err) {
+	SD_DESELECT();
+	if (!err) {
+		uint32_t ticks = ((writer->get_time() - writer->start) & SD_TIME_MASK) >> SD_LATENCY_SHIFT;
+		uint8_t k = 0;
+		for (; ticks > 0 && k < SD_LATENCY_BUCKETS - 1; ticks >>= 1) {
+			++k;
+		}
+		++writer->latency[k];
+	}
+	writer->err = err;
+	writer->state = SD_WRITE_DONE;
+}
+
+void finish_write(struct sdwriter *writer) {
+	while (writer->state != SD_WRITE_IDLE && writer->state != SD_WRITE_DONE) {
+		step_write(writer);
+	}
+}
+
+uint8_t probe_write_speed(struct fatstruct *info, uint8_t *data, uint32_t start_offset, uint8_t blocks, uint8_t writes, uint32_t *mean_ticks, uint32_t *worst_ticks) {
+	struct sdwriter *writer = &info->writer;
+	uint32_t total = 0;
+	*worst_ticks = 0;
+	for (uint8_t i = 0; i < writes; ++i) {
+		uint32_t offset = start_offset + (uint32_t)i * blocks * BLKSIZE;
+		uint32_t start = writer->get_time();
+		uint8_t err = write_multiple_block(data, offset, blocks);
 		if (err) {
 			return err;
 		}
+		uint32_t ticks = (writer->get_time() - start) & SD_TIME_MASK;
+		total += ticks;
+		if (ticks > *worst_ticks) {
+			*worst_ticks = ticks;
+		}
 	}
+	*mean_ticks = (writes > 0) ? total / writes : 0;
+	return SD_SUCCESS;
+}
 
-	index = index % BLKSIZE;	/* Change index from absolute to relative */
+uint8_t is_fat_sector(const struct fatstruct *info, uint32_t offset) {
+	return offset >= info->fatoffset && offset < info->dtoffset;
+}
 
-	/* Point cluster word at index to num cluster */
-	data[index] = WTOB_L(num);
-	data[index+1] =  WTOB_H(num);
+uint8_t write_back_slot(struct fatstruct *info, uint8_t slot) {
+	struct sectorcache *cache = &info->cache;
+	uint32_t offset = cache->offset[slot];
+
+	/* The card is selected until a file data write is done */
+	finish_write(&info->writer);
 
 	/* Write to FAT  */
 	{
-		uint8_t err = write_block(data, block_offset, 512);
+		uint8_t err = write_block(cache->data[slot], offset, BLKSIZE);
 		if (err) {
 			return err;
 		}
 	}
 
 	/* Write to second FAT  */
-	if (info->nfats > 1) {
-		uint8_t err = write_block(data, block_offset + info->fatsize, 512);
+	if (info->nfats > 1 && is_fat_sector(info, offset)) {
+		uint8_t err = write_block(cache->data[slot], offset + info->fatsize, BLKSIZE);
 		if (err) {
 			return err;
 		}
 	}
 
+	cache->dirty[slot] = 0;
 	return FAT_SUCCESS;
 }
 
 /*
- * Update directory table
- *
- * File number is same as entry position, only write to empty entries (not
- * deleted).
- * 1,2,3,4 -> delete 2 -> 1,3,4 -> save file -> 1,3,4,5 -> delete 5 ->
- * 1,3,4 -> save file -> 1,3,4,6
- * When no more empty entries, use deleted entries.
+ * Get the cached copy of the metadata sector at offset, reading it from the SD
+ * card on a miss
  *
- * cluster: file's starting cluster
- * file_size: total bytes in file
- * file_name: file name prefix (truncated if greater than
- * file_num: file name number suffix
- */
-uint8_t update_dir_table(uint8_t *data, struct fatstruct *info, uint16_t cluster, uint32_t file_size, uint8_t *file_name, uint16_t file_num) {
-	/* Directory table entry (MUST BE 32 BYTES) */
-	uint8_t dte[] = "DATA000 CSV\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
-		"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";
-
-	/* Read the directory table. */
-	/* Find the last entry and prepare the next directory table entry. */
-	uint32_t i, j;
-	for (i = 0, j = 0; i < info->dtsize; i += 32) {
-		j = i % info->nbytesinsect;
-		if (j == 0) {
-			/* Next sector */
-			if (read_block(data, info->dtoffset + i, SD_LONG_TIMEOUT)) {
-				/* Couldn't read this block so skip it */
-				i += (info->nbytesinsect - 32);
-				continue;
+ * A miss takes an empty slot, or else the least recently used slot, preferring
+ * clean slots so that a miss doesn't have to write anything back. The sector
+ * pointer is only good until the next call.
+ */
+uint8_t cache_sector(struct fatstruct *info, uint32_t offset, uint8_t **sector) {
+	struct sectorcache *cache = &info->cache;
+	uint8_t slot;
+	for (slot = 0; slot < CACHE_SLOTS && cache->offset[slot] != offset; ++slot);
+
+	if (slot < CACHE_SLOTS) {
+		++cache->hits;
+	} else {
+		++cache->misses;
+		slot = 0;
+		for (uint8_t k = 1; k < CACHE_SLOTS && cache->offset[slot] != CACHE_EMPTY; ++k) {
+			if (cache->offset[k] == CACHE_EMPTY ||
+				cache->dirty[k] < cache->dirty[slot] ||
+				(cache->dirty[k] == cache->dirty[slot] && cache->used[k] < cache->used[slot])) {
+				slot = k;
 			}
 		}
-		
-		/* Check for empty entry (not deleted file (0xE5 prefix)) */
-		if (data[j] == 0x00) {
-			break;	/* Found the entry offset */
-		}
-	}
-
-	/* If no more empty entries, start using deleted entries */
-	if (i >= info->dtsize) {
-		for (i = 0, j = 0; i < info->dtsize; i += 32) {
-			j = i % info->nbytesinsect;
-			if (j == 0) {
-				/* Next sector */
-				if (read_block(data, info->dtoffset + i, SD_LONG_TIMEOUT)) {
-					/* Couldn't read this block so skip it */
-					i += (info->nbytesinsect - 32);
-					continue;
-				}
-			}
-			
-			/* Check for deleted file (0xE5 prefix) */
-			if (data[j] == 0xE5) {
-				break;	/* Found the entry offset */
+		if (cache->dirty[slot]) {
+			uint8_t err = write_back_slot(info, slot);
+			if (err) {
+				return err;
 			}
 		}
-	}
-
-	/* Check if directory table is full */
-	if (i >= info->dtsize) return FAT_DT_FULL;
-	
-	/* Offset of directory table entry */
-	uint32_t dir_entry_offset = info->dtoffset + i;
-	
-	/* Set filename */
-	{
-		uint8_t k = 0;
-		/* Prefix */
-		while (file_name[k] != '\0' && k < MAX_FILE_NAME) {
-			dte[k] = file_name[k];
-			++k;
+		cache->offset[slot] = CACHE_EMPTY;
+		finish_write(&info->writer);
+		uint8_t err = read_block(cache->data[slot], offset, SD_LONG_TIMEOUT);
+		if (err) {
+			return err;
 		}
-		/* Suffix (e.g., "012") */
-		dte[k] = ((file_num / 100) % 10) + 0x30;
-		dte[++k] = ((file_num / 10) % 10) + 0x30;
-		dte[++k] = (file_num % 10) + 0x30;
+		cache->offset[slot] = offset;
 	}
-	
-	/* Set starting cluster */
-	dte[26] = WTOB_L(cluster);
-	dte[27] = WTOB_H(cluster);
-
-	/* Set file size */
-	dte[28] = DTOB_LL(file_size);
-	dte[29] = DTOB_LH(file_size);
-	dte[30] = DTOB_HL(file_size);
-	dte[31] = DTOB_HH(file_size);
 
-	/* Update directory table with new directory table entry */
-	/* index of data at beginning of new dte */
-	i = i % 512;
-	for (j = 0; j < 32; i++, j++) {
-		data[i] = dte[j];
-	}
-	
-	/* We can only write blocks of nbytesinsect bytes, so make sure the offset
-	   we're writing to is at the beginning of a sector */
-	write_block(data, dir_entry_offset - (dir_entry_offset % info->nbytesinsect), 512);
-	
+	cache->used[slot] = ++cache->clock;
+	*sector = cache->data[slot];
 	return FAT_SUCCESS;
 }
 
 /*
- * Find the boot sector, read it (store in data buffer), and verify its
- * validity
+ * Mark a sector returned by cache_sector() as changed so it is written back
+ */
+void mark_sector_dirty(struct fatstruct *info, const uint8_t *sector) {
+	for (uint8_t k = 0; k < CACHE_SLOTS; ++k) {
+		if (info->cache.data[k] == sector) {
+			info->cache.dirty[k] = 1;
+		}
+	}
+}
+
+/*
+ * Write back every changed sector in the cache
+ *
+ * FAT sectors go first so a directory table entry is never on the card before
+ * the cluster chain it covers.
+ */
+uint8_t flush_cache(struct fatstruct *info) {
+	for (uint8_t pass = 0; pass < 2; ++pass) {
+		for (uint8_t k = 0; k < CACHE_SLOTS; ++k) {
+			if (info->cache.dirty[k] && is_fat_sector(info, info->cache.offset[k]) == (pass == 0)) {
+				uint8_t err = write_back_slot(info, k);
+				if (err) {
+					return err;
+				}
+			}
+		}
+	}
+	return FAT_SUCCESS;
+}
+
+/*
+ * Empty the cache without writing anything back
+ */
+void invalidate_cache(struct fatstruct *info) {
+	for (uint8_t k = 0; k < CACHE_SLOTS; ++k) {
+		info->cache.offset[k] = CACHE_EMPTY;
+		info->cache.dirty[k] = 0;
+		info->cache.used[k] = 0;
+	}
+	info->cache.clock = 0;
+	info->cache.hits = 0;
+	info->cache.misses = 0;
+}
+
+/*
+ * Find and return a free cluster for writing file contents (also marks it in
+ * the cached FAT)
+ * Start searching incrementally, starting where the last free cluster was
+ * found (info->freecursor) and wrapping around the end of the FAT, so that
+ * consecutive calls don't rescan the clusters already in use.
+ * Return free cluster index (>0).
+ * Return 0 on error or if there are no more free clusters.
+ */
+uint16_t find_cluster(struct fatstruct *info) {
+	uint8_t *fat = 0;
+	uint32_t i = info->freecursor;
+	for (uint32_t n = 0; n < info->fatsize; i += 2, n += 2) {
+		/* Wrap around to the start of the FAT */
+		if (i >= info->fatsize) {
+			i = 0;
+		}
+		uint32_t j = i % BLKSIZE;	/* Cluster index relative to block */
+				
+		/* Get each new block of the FAT */
+		if (j == 0 || n == 0) {
+			if (cache_sector(info, info->fatoffset + i - j, &fat)) {
+				/* Couldn't read this block so skip it */
+				i += (BLKSIZE - 2 - j);
+				n += (BLKSIZE - 2 - j);
+				continue;
+			}
+		}
+		
+		if (fat[j] == 0x00 && fat[j+1] == 0x00) {
+			
+			/* Set cluster to 0xFFFF to indicate end of cluster chain for current file
+			   (will be modified if file data continues) */
+			fat[j] = 0xFF;
+			fat[j+1] = 0xFF;
+			mark_sector_dirty(info, fat);
+
+			/* Resume the next search after this cluster */
+			info->freecursor = i + 2;
+
+			/* Return free cluster index */
+			return i >> 1;
+		}
+	}
+	
+	/* Failed to find a free cluster (disk may be full) */
+	return 0;
+}
+
+uint8_t find_cluster_run(struct fatstruct *info, uint16_t count, uint16_t *start) {
+	uint8_t *fat = 0;
+	uint32_t nclusts = info->fatsize / 2;
+	uint16_t run = 0;
+	for (uint32_t c = 2; c < nclusts && c < FAT_BAD_CLUST; ++c) {
+		uint32_t i = c * 2;
+		uint32_t j = i % BLKSIZE;	/* Cluster index relative to block */
+
+		/* Get each new block of the FAT */
+		if (j == 0 || c == 2) {
+			uint8_t err = cache_sector(info, info->fatoffset + i - j, &fat);
+			if (err) {
+				return err;
+			}
+		}
+
+		if (fat[j] == 0x00 && fat[j+1] == 0x00) {
+			if (++run == count) {
+				*start = c - count + 1;
+				return FAT_SUCCESS;
+			}
+		} else {
+			run = 0;
+		}
+	}
+	return FAT_DISK_FULL;
+}
+
+uint8_t link_cluster_run(struct fatstruct *info, uint16_t first, uint16_t last) {
+	for (uint16_t c = first; c < last; ++c) {
+		uint8_t err = update_fat(info, (uint32_t)c * 2, c + 1);
+		if (err) {
+			return err;
+		}
+	}
+	return update_fat(info, (uint32_t)last * 2, 0xFFFF);
+}
+
+/*
+ * Return the offset of the given cluster number
+ */
+uint32_t get_cluster_offset(uint16_t clust, struct fatstruct *info) {
+	return info->fileclustoffset + ((clust - 2) * info->nbytesinclust);
+}
+
+/*
+ * Return true if block number is less than nsectsinclust. Otherwise, return false.
+ */
+uint8_t valid_block(uint8_t block, struct fatstruct *info) {
+	return block < info->nsectsinclust;
+}
+
+/*
+ * Update the FAT
+ * Replace the cluster word at byte offset index with num (in the cached FAT).
+ */
+uint8_t update_fat(struct fatstruct *info, uint32_t index, uint16_t num) {
+	/* Get the right block of the FAT  */
+	uint8_t *fat;
+	{
+		uint8_t err = cache_sector(info, info->fatoffset + index - (index % BLKSIZE), &fat);
+		if (err) {
+			return err;
+		}
+	}
+
+	index = index % BLKSIZE;	/* Change index from absolute to relative */
+
+	/* Point cluster word at index to num cluster */
+	fat[index] = WTOB_L(num);
+	fat[index+1] =  WTOB_H(num);
+	mark_sector_dirty(info, fat);
+
+	return FAT_SUCCESS;
+}
+
+
+/*
+ * Read the FAT entry of the given cluster (the next cluster in its chain)
+ */
+uint8_t read_fat(struct fatstruct *info, uint16_t cluster, uint16_t *next) {
+	uint32_t i = (uint32_t)cluster * 2;
+	uint8_t *fat;
+	uint8_t err = cache_sector(info, info->fatoffset + i - (i % BLKSIZE), &fat);
+	if (err) {
+		return err;
+	}
+	i = i % BLKSIZE;
+	*next = BTOW(fat[i], fat[i+1]);
+	return FAT_SUCCESS;
+}
+
+/*
+ * Free a cluster chain starting at the given cluster
+ *
+ * The chain is freed in the cached FAT, so each FAT sector is read once when
+ * the chain enters it and written back once, and every cluster freed costs the
+ * same. The free cluster search resumes at the start of the freed chain so the
+ * space is reused first.
+ */
+uint8_t free_cluster_chain(struct fatstruct *info, uint16_t cluster) {
+	if (cluster >= 2 && cluster < FAT_EOC) {
+		info->freecursor = (uint32_t)cluster * 2;
+	}
+
+	while (cluster >= 2 && cluster < FAT_EOC) {
+		uint32_t i = (uint32_t)cluster * 2;
+		uint8_t *fat;
+		uint8_t err = cache_sector(info, info->fatoffset + i - (i % BLKSIZE), &fat);
+		if (err) {
+			return err;
+		}
+		i = i % BLKSIZE;	/* Index of cluster */
+		cluster = BTOW(fat[i], fat[i+1]);	/* Get next cluster in chain */
+		fat[i] = 0x00;	/* Free cluster */
+		fat[i+1] = 0x00;
+		mark_sector_dirty(info, fat);
+	}
+
+	return FAT_SUCCESS;
+}
+
+/*
+ * Delete the file named file_name with the lowest file number suffix, other
+ * than the one at exclude_offset
+ *
+ * The directory table entry is marked as deleted before its clusters are freed
+ * so that a power cut in between leaves orphaned clusters (which are
+ * recovered) rather than an entry pointing at free clusters.
+ */
+uint8_t delete_oldest_file(struct fatstruct *info, struct dirindex *index, const uint8_t *file_name, uint32_t exclude_offset) {
+	uint32_t oldest_entry = DIR_INDEX_NONE;
+	uint16_t oldest_num = 0xFFFF;
+	uint16_t oldest_cluster = 0;
+
+	/* Find the oldest file */
+	{
+		uint8_t end = 0;
+		for (uint32_t i = 0; i < info->dtsize && !end; i += BLKSIZE) {
+			uint32_t block_offset = info->dtoffset + i;
+			uint8_t *dt;
+			if (cache_sector(info, block_offset, &dt)) {
+				/* Couldn't read this block so skip it */
+				continue;
+			}
+			for (uint16_t j = 0; j < BLKSIZE; j += DTESIZE) {
+				/* End of directory table entries */
+				if (dt[j] == 0x00) {
+					end = 1;
+					break;
+				}
+				if (dt[j] == DTEDEL || block_offset + j == exclude_offset) {
+					continue;
+				}
+				uint16_t num = dir_entry_file_num(file_name, dt, j);
+				if (num > 0 && num < oldest_num) {
+					oldest_num = num;
+					oldest_entry = block_offset + j;
+					oldest_cluster = BTOW(dt[j+26], dt[j+27]);
+				}
+			}
+		}
+	}
+
+	if (oldest_entry == DIR_INDEX_NONE) {
+		return FAT_NO_FILE;
+	}
+
+	/* Mark directory table entry as deleted */
+	{
+		uint8_t *dt;
+		uint8_t err = cache_sector(info, oldest_entry - (oldest_entry % BLKSIZE), &dt);
+		if (err) {
+			return err;
+		}
+		dt[oldest_entry % BLKSIZE] = DTEDEL;
+		mark_sector_dirty(info, dt);
+		/* The entry has to be on the card before the chain is freed */
+		err = flush_cache(info);
+		if (err) {
+			return err;
+		}
+	}
+
+	/* Resume the deleted entry search at or before this entry */
+	if (index->deleted_entry == DIR_INDEX_NONE || oldest_entry < index->deleted_entry) {
+		index->deleted_entry = oldest_entry;
+	}
+
+	/* Free cluster chain in FAT */
+	return free_cluster_chain(info, oldest_cluster);
+}
+
+/*
+ * Find the boot sector, read it (store in data buffer), and verify its
+ * validity
  */
 uint8_t valid_boot_sector(uint8_t *data, struct fatstruct *boot) {
 	/* Find boot sector */
@@ -626,9 +1213,33 @@ uint8_t parse_boot_sector(uint8_t *data, struct fatstruct *info) {
 	/* Get location of first cluster to be used by file data */
 	info->fileclustoffset = info->dtoffset + info->dtsize;
 
+	/* Start searching for free clusters at the start of the FAT */
+	info->freecursor = 0;
+
+	/* Nothing cached belongs to this card */
+	invalidate_cache(info);
+
 	return FAT_SUCCESS;
 }
 
+void save_fat_geometry(const struct fatstruct *info, uint8_t *geometry) {
+	const uint8_t *fields = (const uint8_t *)info;
+	for (uint8_t i = 0; i < FAT_GEOMETRY_SIZE; ++i) {
+		geometry[i] = fields[i];
+	}
+}
+
+void load_fat_geometry(struct fatstruct *info, const uint8_t *geometry) {
+	uint8_t *fields = (uint8_t *)info;
+	for (uint8_t i = 0; i < FAT_GEOMETRY_SIZE; ++i) {
+		fields[i] = geometry[i];
+	}
+
+	/* Same as after parse_boot_sector() */
+	info->freecursor = 0;
+	invalidate_cache(info);
+}
+
 /*
  * Delete a file
  *
@@ -649,24 +1260,14 @@ void delete_file(uint8_t dten, uint32_t curoffset, uint8_t *data, struct fatstru
 	uint16_t cluster = BTOW(data[dte_offset+26], data[dte_offset+27]);
 
 	/* Free cluster chain in FAT */
-	while (cluster != 0xFFFF) {
-		/* Read appropriate block of FAT */
-		uint32_t block_offset = info->fatoffset;
-		if (cluster >= 256) {
-			block_offset += (cluster * 2) % 512;
-		}
-		read_block(data, block_offset, SD_LONG_TIMEOUT);
+	free_cluster_chain(info, cluster);
 
-		uint16_t i = (cluster % 256) * 2;	/* Index of cluster */
-		cluster = BTOW(data[i], data[i+1]);	/* Get next cluster in chain */
-		data[i] = 0x00;	/* Free cluster */
-		data[i+1] = 0x00;
-		write_block(data, block_offset, 512);
+	uint8_t *dt;
+	if (cache_sector(info, curoffset, &dt)) {
+		return;
 	}
-
-	read_block(data, curoffset, SD_LONG_TIMEOUT);
-	data[dte_offset+0] = 0xE5;	/* Mark directory table entry as deleted */
-	write_block(data, curoffset, 512);
+	dt[dte_offset+0] = 0xE5;	/* Mark directory table entry as deleted */
+	mark_sector_dirty(info, dt);
 }
 
 void fat_defaults(struct fatstruct *info) {
@@ -675,6 +1276,8 @@ void fat_defaults(struct fatstruct *info) {
 	info->fatoffset = 1024;
 	info->nfats = 2;
 	info->fatsize = 122368;
+	info->freecursor = 0;
+	invalidate_cache(info);
 }
 
 /*
@@ -695,6 +1298,9 @@ void fat_defaults(struct fatstruct *info) {
  * total sectors:				3842048
  */
 void format_sd(uint8_t *data, struct fatstruct *info, void (*pre_format)(), void (*during_format)(), void (*post_format)()) {
+	/* Every metadata sector is rewritten */
+	invalidate_cache(info);
+
 	/* Clear block 0 up to directory table */
 	for (uint32_t j = 0; j < info->dtoffset; j += 512) {
 		write_block(data, j, 0);
@@ -813,7 +1419,7 @@ void format_sd(uint8_t *data, struct fatstruct *info, void (*pre_format)(), void
 					for (uint8_t k = 0; k < 32; k++) data[k] = data[i+k];
 					write_block(data, info->dtoffset, 32);
 					uint16_t config_clust = BTOW(data[26], data[27]);
-					update_fat(data, info, config_clust * 2, 0xFFFF);
+					update_fat(info, (uint32_t)config_clust * 2, 0xFFFF);
 					break;
 				}
 			}
@@ -827,70 +1433,814 @@ void format_sd(uint8_t *data, struct fatstruct *info, void (*pre_format)(), void
 		}
 	}
 	
+	/* Write the config file's FAT entry */
+	flush_cache(info);
+
 	/* Indicate that format has completed */
 	post_format();
 }
 
-uint16_t get_file_num(uint8_t *data, const struct fatstruct *info, const uint8_t *file_name) {
+uint32_t file_name_match_end(const uint8_t *file_name, const uint8_t *string, uint32_t offset) {
+	uint8_t i = 0;
+	while (file_name[i] != '\0' && i < MAX_FILE_NAME) {
+		if (file_name[i] != string[offset + i]) {
+			return 0;
+		}
+		++i;
+	}
+	return offset + i;
+}
+
+uint16_t dir_entry_file_num(const uint8_t *file_name, const uint8_t *data, uint32_t offset) {
+	uint32_t k = file_name_match_end(file_name, data, offset);
+	if (k == 0) {
+		return 0;
+	}
+	uint16_t first_digit = data[k] - 0x30;
+	if (first_digit > 9) {
+		return 0;
+	}
+	uint16_t second_digit = data[++k] - 0x30;
+	if (second_digit > 9) {
+		return 0;
+	}
+	uint16_t third_digit = data[++k] - 0x30;
+	if (third_digit > 9) {
+		return 0;
+	}
+	return (first_digit * 100) + (second_digit * 10) + third_digit;
+}
+
+uint8_t is_config_entry(const uint8_t *data, uint32_t offset) {
+	return data[offset] == 'C' &&
+		data[offset + 1] == 'O' &&
+		data[offset + 2] == 'N' &&
+		data[offset + 3] == 'F' &&
+		data[offset + 4] == 'I' &&
+		data[offset + 5] == 'G' &&
+		data[offset + 6] == ' ' &&
+		data[offset + 7] == ' ' &&
+		data[offset + 8] == 'I' &&
+		data[offset + 9] == 'N' &&
+		data[offset + 10] == 'I';
+}
+
+/*
+ * Build the directory table index
+ *
+ * Entries are read up to the first empty entry (0x00 prefix); every entry after
+ * it is empty as well, so the rest of the table does not need to be read.
+ * Keeps track of the highest file number suffix, the first deleted entry and
+ * the CONFIG.INI entry along the way.
+ */
+uint8_t build_dir_index(uint8_t *data, struct fatstruct *info, const uint8_t *file_name, struct dirindex *index) {
+	/* The directory table is read from the card */
+	{
+		uint8_t err = flush_cache(info);
+		if (err) {
+			return err;
+		}
+	}
+
 	/* Highest file number suffix */
 	uint16_t max = 0;
-	/* Directory table byte count */
-	uint32_t i = 0;
-	/* Directory table entry address */
-	uint32_t j = 0;
-	
-	/* TODO desc */
-	do {
-		/* Check for end of sector */
-		if (i % info->nbytesinsect == 0) {
-			/* Read next sector */
-			if (read_block(data, info->dtoffset + i, SD_LONG_TIMEOUT)) {
-				/* Couldn't read this block so skip it */
-				i += info->nbytesinsect;
+
+	index->free_entry = DIR_INDEX_NONE;
+	index->deleted_entry = DIR_INDEX_NONE;
+	index->config_entry = DIR_INDEX_NONE;
+	index->config_cluster = 0;
+	index->config_size = 0;
+	index->config_time = 0;
+	index->config_date = 0;
+
+	for (uint32_t i = 0; i < info->dtsize && index->free_entry == DIR_INDEX_NONE; i += info->nbytesinsect) {
+		uint32_t block_offset = info->dtoffset + i;
+		if (read_block(data, block_offset, SD_LONG_TIMEOUT)) {
+			/* Couldn't read this block so skip it */
+			continue;
+		}
+		for (uint16_t j = 0; j < info->nbytesinsect; j += DTESIZE) {
+			/* End of directory table entries */
+			if (data[j] == 0x00) {
+				index->free_entry = block_offset + j;
+				break;
+			}
+			/* Deleted file */
+			if (data[j] == DTEDEL) {
+				if (index->deleted_entry == DIR_INDEX_NONE) {
+					index->deleted_entry = block_offset + j;
+				}
 				continue;
 			}
-			j = 0;
-		}
-		/* Convert 3 byte ASCII file number suffix to integer */
-		if (data[j] != DTEDEL) {
-			uint32_t k = file_name_match_end(file_name, data, j);
-			if (k > 0) {
-				uint16_t first_digit = data[k] - 0x30;
-				if (first_digit <= 9) {
-					uint16_t second_digit = data[++k] - 0x30;
-					if (second_digit <= 9) {
-						uint16_t third_digit = data[++k] - 0x30;
-						if (third_digit <= 9) {
-							/* Current file number suffix */
-							uint16_t num = (first_digit * 100) + (second_digit * 10) + third_digit;
-							/* Keep track of highest file number suffix */
-							if (num > max) {
-								max = num;
-							}
-						}
+			/* Config file */
+			if (is_config_entry(data, j)) {
+				index->config_entry = block_offset + j;
+				index->config_cluster = BTOW(data[j+26], data[j+27]);
+				index->config_size = BTOD(data[j+28], data[j+29], data[j+30], data[j+31]);
+				index->config_time = BTOW(data[j+22], data[j+23]);
+				index->config_date = BTOW(data[j+24], data[j+25]);
+				continue;
+			}
+			/* Keep track of highest file number suffix */
+			uint16_t num = dir_entry_file_num(file_name, data, j);
+			if (num > max) {
+				max = num;
+			}
+		}
+	}
+
+	index->next_file_num = max + 1;
+
+	return FAT_SUCCESS;
+}
+
+uint8_t same_config_entry(uint8_t *data, const struct dirindex *index) {
+	if (index->config_entry == DIR_INDEX_NONE) {
+		return 0;
+	}
+
+	uint32_t block_offset = index->config_entry - (index->config_entry % BLKSIZE);
+	if (read_block(data, block_offset, SD_LONG_TIMEOUT)) {
+		return 0;
+	}
+
+	uint16_t j = index->config_entry - block_offset;
+	return is_config_entry(data, j) &&
+		BTOW(data[j+26], data[j+27]) == index->config_cluster &&
+		BTOD(data[j+28], data[j+29], data[j+30], data[j+31]) == index->config_size &&
+		BTOW(data[j+22], data[j+23]) == index->config_time &&
+		BTOW(data[j+24], data[j+25]) == index->config_date;
+}
+
+/*
+ * Reserve a directory table entry
+ *
+ * Empty entries are used first so that the file number stays the same as the
+ * entry position. When no more empty entries, start using deleted entries.
+ * Only the deleted entry search reads from the card, and only once the empty
+ * entries have run out.
+ */
+uint8_t reserve_dir_entry(struct fatstruct *info, struct dirindex *index, uint32_t *entry_offset, uint16_t *file_num) {
+	uint8_t err = claim_dir_entry(info, index, entry_offset);
+	if (err) {
+		return err;
+	}
+
+	*file_num = index->next_file_num++;
+
+	return FAT_SUCCESS;
+}
+
+uint8_t claim_dir_entry(struct fatstruct *info, struct dirindex *index, uint32_t *entry_offset) {
+	uint32_t dt_end = info->dtoffset + info->dtsize;
+	uint8_t *data = 0;
+
+	if (index->free_entry != DIR_INDEX_NONE) {
+		*entry_offset = index->free_entry;
+		/* The entry after the last one is empty as well */
+		index->free_entry += DTESIZE;
+		if (index->free_entry >= dt_end) {
+			index->free_entry = DIR_INDEX_NONE;
+		}
+	} else {
+		/* Resume searching for a deleted entry where the last search ended */
+		uint32_t start = index->deleted_entry;
+		index->deleted_entry = DIR_INDEX_NONE;
+		if (start == DIR_INDEX_NONE) {
+			return FAT_DT_FULL;
+		}
+		uint32_t found = DIR_INDEX_NONE;
+		for (uint32_t i = start; i < dt_end && found == DIR_INDEX_NONE; i += DTESIZE) {
+			uint16_t j = i % info->nbytesinsect;
+			if (j == 0 || i == start) {
+				/* Read the sector holding this entry */
+				if (cache_sector(info, i - j, &data)) {
+					/* Couldn't read this block so skip it */
+					i += (info->nbytesinsect - j - DTESIZE);
+					continue;
+				}
+			}
+			if (data[j] == DTEDEL) {
+				found = i;
+			}
+		}
+		/* Check if directory table is full */
+		if (found == DIR_INDEX_NONE) {
+			return FAT_DT_FULL;
+		}
+		*entry_offset = found;
+		if (found + DTESIZE < dt_end) {
+			index->deleted_entry = found + DTESIZE;
+		}
+	}
+
+	return FAT_SUCCESS;
+}
+
+uint8_t write_dir_entry(struct fatstruct *info, uint32_t entry_offset, const uint8_t *file_name, const uint8_t *ext, uint16_t file_num, uint16_t cluster, uint32_t file_size) {
+	/* Get the sector holding the entry */
+	uint8_t *data;
+	{
+		uint8_t err = cache_sector(info, entry_offset - (entry_offset % info->nbytesinsect), &data);
+		if (err) {
+			return err;
+		}
+	}
+
+	/* Index of data at beginning of entry */
+	uint16_t i = entry_offset % info->nbytesinsect;
+	uint8_t *dte = &data[i];
+
+	/* Set filename */
+	{
+		uint8_t k = 0;
+		/* Prefix */
+		while (file_name[k] != '\0' && k < MAX_FILE_NAME) {
+			dte[k] = file_name[k];
+			++k;
+		}
+		/* Suffix (e.g., "012") */
+		dte[k++] = ((file_num / 100) % 10) + 0x30;
+		dte[k++] = ((file_num / 10) % 10) + 0x30;
+		dte[k++] = (file_num % 10) + 0x30;
+		/* Pad name with spaces */
+		while (k < 8) {
+			dte[k++] = ' ';
+		}
+		/* Extension */
+		dte[k++] = ext[0];
+		dte[k++] = ext[1];
+		dte[k++] = ext[2];
+		/* Attributes, times and dates */
+		while (k < 26) {
+			dte[k++] = 0x00;
+		}
+	}
+
+	/* Set starting cluster */
+	dte[26] = WTOB_L(cluster);
+	dte[27] = WTOB_H(cluster);
+
+	/* Set file size */
+	dte[28] = DTOB_LL(file_size);
+	dte[29] = DTOB_LH(file_size);
+	dte[30] = DTOB_HL(file_size);
+	dte[31] = DTOB_HH(file_size);
+
+	mark_sector_dirty(info, data);
+
+	return FAT_SUCCESS;
+}
+
+uint16_t scratch_word(const uint8_t *scratch, uint16_t i) {
+	return BTOW(scratch[2*i], scratch[2*i + 1]);
+}
+
+void set_scratch_word(uint8_t *scratch, uint16_t i, uint16_t w) {
+	scratch[2*i] = WTOB_L(w);
+	scratch[2*i + 1] = WTOB_H(w);
+}
+
+uint8_t scratch_has_word(const uint8_t *scratch, uint16_t n, uint16_t w) {
+	/* Binary search */
+	uint16_t lo = 0;
+	uint16_t hi = n;
+	while (lo < hi) {
+		uint16_t mid = lo + ((hi - lo) >> 1);
+		uint16_t m = scratch_word(scratch, mid);
+		if (m == w) {
+			return 1;
+		} else if (m < w) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+uint32_t tail_cluster_size(uint8_t *data, struct fatstruct *info, uint16_t cluster) {
+	uint32_t cluster_offset = get_cluster_offset(cluster, info);
+	for (uint8_t b = 0; b < info->nsectsinclust; ++b) {
+		uint32_t block_size = (uint32_t)b * BLKSIZE;
+		if (read_block(data, cluster_offset + block_size, SD_LONG_TIMEOUT)) {
+			return block_size;
+		}
+		/* Block was never written */
+		if (data[0] == 0x00 || data[0] == 0xFF) {
+			return block_size;
+		}
+		/* Padding of the last block written */
+		for (uint16_t i = 1; i < BLKSIZE; ++i) {
+			if (data[i] == 0x00) {
+				return block_size + i;
+			}
+		}
+	}
+	return info->nbytesinclust;
+}
+
+/*
+ * Recover orphaned cluster chains
+ *
+ * A cluster starts a chain if it is in use and the cluster before it doesn't
+ * point to it, unless some other cluster jumps to it. Files are written to
+ * consecutive clusters, so only the links that don't point to the next cluster
+ * need to be kept. A chain is orphaned if it doesn't start at a cluster in the
+ * directory table.
+ *
+ * 1. Stream the directory table and keep the sorted starting clusters.
+ * 2. Stream the FAT once, keeping chain starts that aren't in the directory
+ *    table and the targets of non-consecutive links.
+ * 3. Drop the chain starts that are jumped to, then follow each remaining chain
+ *    (reading a FAT sector only when the chain leaves the last one) and give it
+ *    a directory table entry.
+ */
+uint8_t recover_orphans(uint8_t *data, struct fatstruct *info, struct dirindex *index, const uint8_t *file_name, uint8_t *scratch, uint16_t scratch_size) {
+	uint16_t scratch_words = scratch_size / 2;
+	uint32_t nclusts = info->fatsize / 2;
+
+	/* The directory table and the FAT are streamed from the card */
+	{
+		uint8_t err = flush_cache(info);
+		if (err) {
+			return err;
+		}
+	}
+
+	/* Starting clusters of the directory table entries */
+	uint16_t nfiles = 0;
+	{
+		uint8_t err = read_multiple_block_start(info->dtoffset);
+		if (err) {
+			return err;
+		}
+		uint8_t end = 0;
+		for (uint32_t i = 0; i < info->dtsize && !end; i += BLKSIZE) {
+			err = read_multiple_block_next(data, SD_LONG_TIMEOUT);
+			if (err) {
+				break;
+			}
+			for (uint16_t j = 0; j < BLKSIZE; j += DTESIZE) {
+				/* End of directory table entries */
+				if (data[j] == 0x00) {
+					end = 1;
+					break;
+				}
+				/* Deleted file */
+				if (data[j] == DTEDEL) {
+					continue;
+				}
+				uint16_t cluster = BTOW(data[j+26], data[j+27]);
+				if (cluster < 2) {
+					continue;
+				}
+				if (nfiles == scratch_words) {
+					err = FAT_SCRATCH_FULL;
+					break;
+				}
+				/* Insertion sort */
+				uint16_t k = nfiles++;
+				while (k > 0 && scratch_word(scratch, k - 1) > cluster) {
+					set_scratch_word(scratch, k, scratch_word(scratch, k - 1));
+					--k;
+				}
+				set_scratch_word(scratch, k, cluster);
+			}
+			if (err) {
+				break;
+			}
+		}
+		read_multiple_block_stop();
+		if (err) {
+			return err;
+		}
+	}
+
+	/* Chain starts not in the directory table, and non-consecutive link targets */
+	uint16_t heads[MAX_ORPHANS];
+	uint8_t nheads = 0;
+	uint16_t njumps = 0;
+	{
+		uint8_t err = read_multiple_block_start(info->fatoffset);
+		if (err) {
+			return err;
+		}
+		/* Value of the previous cluster */
+		uint16_t prev = 0;
+		for (uint32_t c = 0; c < nclusts; ++c) {
+			uint16_t j = (c * 2) % BLKSIZE;
+			if (j == 0) {
+				err = read_multiple_block_next(data, SD_LONG_TIMEOUT);
+				if (err) {
+					break;
+				}
+			}
+			uint16_t v = BTOW(data[j], data[j+1]);
+			if (c >= 2 && v != 0x0000 && v != FAT_BAD_CLUST) {
+				/* Chain start */
+				if (prev != c && nheads < MAX_ORPHANS && !scratch_has_word(scratch, nfiles, c)) {
+					heads[nheads++] = c;
+				}
+				/* Non-consecutive link */
+				if (v < FAT_EOC && v != c + 1) {
+					if (nfiles + njumps == scratch_words) {
+						err = FAT_SCRATCH_FULL;
+						break;
 					}
+					set_scratch_word(scratch, nfiles + njumps++, v);
 				}
 			}
+			prev = v;
 		}
-		/* Update byte counter */
-		i += 32;
-		/* Address of next directory table entry */
-		j = i % info->nbytesinsect;
-	} while (i < info->dtsize && data[j] != 0x00);
-	
-	/* Return the highest usable file number suffix */
-	return max + 1;
+		read_multiple_block_stop();
+		if (err) {
+			return err;
+		}
+	}
+
+	for (uint8_t h = 0; h < nheads; ++h) {
+		uint16_t head = heads[h];
+		/* Skip chain starts that another cluster jumps to */
+		uint8_t jumped_to = 0;
+		for (uint16_t k = 0; k < njumps && !jumped_to; ++k) {
+			jumped_to = scratch_word(scratch, nfiles + k) == head;
+		}
+		if (jumped_to) {
+			continue;
+		}
+
+		/* Follow the chain to count its clusters and find its last cluster */
+		uint32_t count = 0;
+		uint16_t tail = head;
+		for (uint16_t c = head; c >= 2 && c < FAT_EOC && count < nclusts; ++count) {
+			uint16_t next;
+			if (read_fat(info, c, &next)) {
+				break;
+			}
+			tail = c;
+			c = next;
+		}
+		if (count == 0) {
+			continue;
+		}
+
+		uint32_t file_size = (count - 1) * info->nbytesinclust + tail_cluster_size(data, info, tail);
+
+		/* Give the chain a directory table entry */
+		uint32_t entry_offset;
+		uint16_t file_num;
+		uint8_t err = reserve_dir_entry(info, index, &entry_offset, &file_num);
+		if (err) {
+			return err;
+		}
+		err = write_dir_entry(info, entry_offset, file_name, (const uint8_t *)"CSV", file_num, head, file_size);
+		if (err) {
+			return err;
+		}
+	}
+
+	return flush_cache(info);
 }
 
-uint32_t file_name_match_end(const uint8_t *file_name, const uint8_t *string, uint32_t offset) {
-	uint8_t i = 0;
-	while (file_name[i] != '\0' && i < MAX_FILE_NAME) {
-		if (file_name[i] != string[offset + i]) {
-			return 0;
+void construct_file(struct sdfile *file, struct fatstruct *info, struct dirindex *dir, const uint8_t *name, const uint8_t *ext, uint8_t *buffer, uint16_t buffer_size) {
+	file->info = info;
+	file->dir = dir;
+	{
+		uint8_t k = 0;
+		for (; name[k] != '\0' && k < MAX_FILE_NAME; ++k) {
+			file->name[k] = name[k];
 		}
-		++i;
+		file->name[k] = '\0';
 	}
-	return offset + i;
+	for (uint8_t k = 0; k < 3; ++k) {
+		file->ext[k] = ext[k];
+	}
+	file->buffer = buffer;
+	file->buffer_size = buffer_size;
+	file->index = 0;
+	file->head = 0;
+	file->queued = 0;
+	file->batch = 1;
+	file->start_cluster = 0;
+	file->cluster = 0;
+	file->block_num = 0;
+	file->size = 0;
+	file->entry_offset = DIR_INDEX_NONE;
+	file->file_num = 0;
+	file->unsynced_clusters = 0;
+	file->ring = 0;
+	file->reserved_end = 0;
+}
+
+uint8_t open_file(struct sdfile *file, uint16_t file_num) {
+	file->index = 0;
+	file->head = 0;
+	file->queued = 0;
+	file->block_num = 0;
+	file->size = 0;
+	file->unsynced_clusters = 0;
+	file->reserved_end = 0;
+	/* No entry is open yet, so none is excluded from ring mode reclaims */
+	file->entry_offset = DIR_INDEX_NONE;
+
+	file->start_cluster = next_file_cluster(file);
+	if (!file->start_cluster) {
+		return FAT_DISK_FULL;
+	}
+	file->cluster = file->start_cluster;
+
+	/* Claim the directory table entry */
+	{
+		uint8_t err;
+		if (file_num) {
+			file->file_num = file_num;
+			err = claim_dir_entry(file->info, file->dir, &file->entry_offset);
+		} else {
+			err = reserve_dir_entry(file->info, file->dir, &file->entry_offset, &file->file_num);
+		}
+		if (err) {
+			return err;
+		}
+	}
+
+	/*
+	 * Write the entry now with an empty size so the file's clusters are never
+	 * orphaned if logging is cut off
+	 */
+	return sync_file(file);
+}
+
+uint8_t open_burst_file(struct sdfile *file, uint16_t clusters) {
+	file->index = 0;
+	file->head = 0;
+	file->queued = 0;
+	file->block_num = 0;
+	file->size = 0;
+	file->unsynced_clusters = 0;
+	file->entry_offset = DIR_INDEX_NONE;
+
+	/* Reserve the run: nothing else claims clusters until the file is closed */
+	{
+		uint8_t err = find_cluster_run(file->info, clusters, &file->start_cluster);
+		if (err) {
+			return err;
+		}
+	}
+	file->cluster = file->start_cluster;
+	file->reserved_end = file->start_cluster + clusters;
+
+	/* Claim the directory table entry in the index only */
+	return reserve_dir_entry(file->info, file->dir, &file->entry_offset, &file->file_num);
+}
+
+uint8_t append_file(struct sdfile *file, uint8_t value) {
+	/* Wait for the oldest block to be written if every block is queued */
+	while (file->queued == file->buffer_size / BLKSIZE) {
+		uint8_t err = step_file(file);
+		if (err) {
+			return err;
+		}
+	}
+	file->buffer[file->index++] = value;
+	if (file->index == file->buffer_size) {
+		file->index = 0;
+	}
+	/* Block is full */
+	if (file->index % BLKSIZE == 0) {
+		queue_file_blocks(file);
+		return step_file(file);
+	}
+	return FAT_SUCCESS;
+}
+
+uint16_t unqueued_bytes(const struct sdfile *file) {
+	uint16_t tail = file->head + (uint16_t)file->queued * BLKSIZE;
+	if (tail >= file->buffer_size) {
+		tail -= file->buffer_size;
+	}
+	if (file->index >= tail) {
+		return file->index - tail;
+	}
+	return file->index + file->buffer_size - tail;
+}
+
+/*
+ * Bytes can also be put in the buffer directly (for a header) as long as they
+ * don't fill it, so more than one block may have filled.
+ */
+void queue_file_blocks(struct sdfile *file) {
+	while (file->queued < file->buffer_size / BLKSIZE && unqueued_bytes(file) >= BLKSIZE) {
+		++file->queued;
+	}
+}
+
+uint32_t file_length(const struct sdfile *file) {
+	return file->size + (uint32_t)file->queued * BLKSIZE + unqueued_bytes(file);
+}
+
+uint8_t step_file(struct sdfile *file) {
+	return advance_file(file, file->batch);
+}
+
+uint8_t advance_file(struct sdfile *file, uint8_t min_blocks) {
+	struct sdwriter *writer = &file->info->writer;
+	/* Advance the write in progress, which may belong to another file */
+	if (writer->state != SD_WRITE_IDLE) {
+		if (step_write(writer) != SD_WRITE_DONE) {
+			return FAT_SUCCESS;
+		}
+		uint8_t err = end_file_write(writer->owner);
+		if (err) {
+			return err;
+		}
+	}
+	if (file->queued > 0 && file->queued >= min_blocks) {
+		return start_file_write(file);
+	}
+	return FAT_SUCCESS;
+}
+uint8_t start_file_write(struct sdfile *file) {
+	struct fatstruct *info = file->info;
+	/* Stop at the end of the buffer and at the end of the cluster */
+	uint8_t blocks = file->queued;
+	uint8_t buffer_blocks = (file->buffer_size - file->head) / BLKSIZE;
+	uint8_t cluster_blocks = info->nsectsinclust - file->block_num;
+	if (blocks > buffer_blocks) {
+		blocks = buffer_blocks;
+	}
+	if (blocks > cluster_blocks) {
+		blocks = cluster_blocks;
+	}
+	if (blocks == 0) {
+		return FAT_DISK_FULL;
+	}
+	uint32_t block_offset = get_cluster_offset(file->cluster, info);
+	block_offset += (uint32_t)file->block_num * BLKSIZE;
+	start_write(&info->writer, file, file->buffer + file->head, block_offset, blocks);
+	return FAT_SUCCESS;
+}
+uint8_t end_file_write(struct sdfile *file) {
+	struct sdwriter *writer = &file->info->writer;
+	writer->state = SD_WRITE_IDLE;
+	if (writer->err) {
+		return writer->err;
+	}
+	/* Prepare for writing next block */
+	{
+		uint16_t bytes_written = (uint16_t)writer->blocks * BLKSIZE;
+		file->size += bytes_written;
+		file->queued -= writer->blocks;
+		file->head += bytes_written;
+		if (file->head == file->buffer_size) {
+			file->head = 0;
+		}
+		file->block_num += writer->blocks;
+	}
+
+	/* Cluster is full */
+	if (!valid_block(file->block_num, file->info)) {
+		/* A burst file moves on through its run without touching the FAT */
+		if (file->reserved_end) {
+			if (file->cluster + 1 < file->reserved_end) {
+				++file->cluster;
+				file->block_num = 0;
+			}
+			return FAT_SUCCESS;
+		}
+		/* Find another cluster */
+		uint16_t next_cluster = next_file_cluster(file);
+		if (!next_cluster) {
+			return FAT_DISK_FULL;
+		}
+		/* Link it in the cached FAT, written back with the other open files' links */
+		uint8_t err = update_fat(file->info, (uint32_t)file->cluster * 2, next_cluster);
+		if (err) {
+			return err;
+		}
+		file->cluster = next_cluster;
+		file->block_num = 0;
+		++file->unsynced_clusters;
+	}
+
+	return FAT_SUCCESS;
+}
+uint16_t next_file_cluster(struct sdfile *file) {
+	struct fatstruct *info = file->info;
+	uint16_t cluster = find_cluster(info);
+	if (cluster || !file->ring) {
+		return cluster;
+	}
+	/*
+	 * The SD card is full: delete the oldest file with this name other than
+	 * this one. Freeing its chain moves the free cluster search to the start of
+	 * it, so the next search finds a cluster straight away.
+	 */
+	uint8_t err = delete_oldest_file(info, file->dir, file->name, file->entry_offset);
+	if (err == FAT_SUCCESS) {
+		return find_cluster(info);
+	}
+	if (err != FAT_NO_FILE || file->entry_offset == DIR_INDEX_NONE) {
+		return 0;
+	}
+	/*
+	 * This is the only file left, so drop its oldest cluster. The entry is
+	 * moved past the cluster before the cluster is freed so a power cut in
+	 * between only leaves an orphan behind.
+	 */
+	uint16_t head = file->start_cluster;
+	uint16_t next;
+	if (read_fat(info, head, &next) != FAT_SUCCESS ||
+		next < 2 || next >= FAT_EOC) {
+		return 0;
+	}
+	file->start_cluster = next;
+	file->size -= info->nbytesinclust;
+	if (write_file_entry(file) != FAT_SUCCESS ||
+		flush_cache(info) != FAT_SUCCESS ||
+		update_fat(info, (uint32_t)head * 2, 0) != FAT_SUCCESS) {
+		return 0;
+	}
+	/* Reuse the freed cluster without searching the FAT */
+	info->freecursor = (uint32_t)head * 2;
+	return find_cluster(info);
+}
+
+uint8_t write_file_entry(struct sdfile *file) {
+	return write_dir_entry(file->info,
+							file->entry_offset,
+							file->name,
+							file->ext,
+							file->file_num,
+							file->start_cluster,
+							file->size);
+}
+
+uint8_t sync_file(struct sdfile *file) {
+	{
+		uint8_t err = write_file_entry(file);
+		if (err) {
+			return err;
+		}
+	}
+	/* The chain is written back before the entry that covers it */
+	{
+		uint8_t err = flush_cache(file->info);
+		if (err) {
+			return err;
+		}
+	}
+	file->unsynced_clusters = 0;
+	return FAT_SUCCESS;
 }
 
+uint8_t drain_file(struct sdfile *file) {
+	queue_file_blocks(file);
+	while (file->queued > 0 || file->info->writer.state != SD_WRITE_IDLE) {
+		uint8_t err = advance_file(file, 1);
+		if (err) {
+			return err;
+		}
+	}
+	return FAT_SUCCESS;
+}
+
+uint8_t close_file(struct sdfile *file) {
+	/* Write the full blocks in the background writer */
+	{
+		uint8_t err = drain_file(file);
+		if (err) {
+			return err;
+		}
+	}
+
+	/* Then the remaining bytes, which are less than a block */
+	uint8_t partial = file->index != file->head;
+	if (partial) {
+		uint32_t block_offset = get_cluster_offset(file->cluster, file->info);
+		block_offset += (uint32_t)file->block_num * BLKSIZE;
+		uint16_t count = file->index - file->head;
+		uint8_t err = write_block(file->buffer + file->head, block_offset, count);
+		if (err) {
+			return err;
+		}
+		file->size += count;
+		file->index = file->head;
+	}
+
+	/* Chain a burst file's clusters, leaving out a last cluster with no data */
+	if (file->reserved_end) {
+		uint16_t last = file->cluster;
+		if (file->block_num == 0 && !partial && last != file->start_cluster) {
+			--last;
+		}
+		uint8_t err = link_cluster_run(file->info, file->start_cluster, last);
+		if (err) {
+			return err;
+		}
+		file->reserved_end = 0;
+	}
+
+	return sync_file(file);
+}
 #endif
@@ -19,18 +19,22 @@ enum SDErrCodes {
 	SD_TIMEOUT,
 	SD_BAD_TYPE,
 	SD_NOT_HC,
-	SD_BAD_TOKEN
+	SD_BAD_TOKEN,
+	SD_BAD_CRC
 };
 
 typedef enum {
 	CMD0 = 0,		/* GO_IDLE_STATE */
 	CMD8 = 8,		/* SEND_IF_COND */
+	CMD12 = 12,		/* STOP_TRANSMISSION */
 	CMD13 = 13,		/* SEND_STATUS */
 	CMD17 = 17,		/* READ_SINGLE_BLOCK */
+	CMD18 = 18,		/* READ_MULTIPLE_BLOCK */
 	CMD24 = 24,		/* WRITE_BLOCK */
  	CMD25 = 25,		/* WRITE_MULTIPLE_BLOCK */
 	CMD55 = 55,		/* APP_CMD */
 	CMD58 = 58,		/* READ_OCR */
+	CMD59 = 59,		/* CRC_ON_OFF */
 	ACMD23 = 23,	/* SET_WR_BLK_ERASE_COUNT */
 	ACMD41 = 41		/* SD_SEND_OP_COND */
 } SDcmd;
@@ -49,12 +53,16 @@ enum SDCardType {
 	CT_SDHC = (CT_SD2 | CT_BLOCK)	/* SDHC */
 };
 
+/* Bytes polled are sized for the fast SPI clock (SMCLK, see spia_fast()) */
 enum SDTimeout {
 	SD_SHORT_TIMEOUT = 10,
-	SD_MED_TIMEOUT = 0x200,
-	SD_LONG_TIMEOUT = 0x1000
+	SD_MED_TIMEOUT = 0x600,
+	SD_LONG_TIMEOUT = 0x3000
 };
 
+/* Bytes polled while waiting for the card to finish programming (over 0.5 s) */
+#define SD_BUSY_POLLS	750000UL
+
 enum SDTokens{
 	SD_NOT_BUSY = 0xFF,
 	SD_START_BLOCK = 0xFE,
@@ -63,9 +71,16 @@ enum SDTokens{
 	SD_MULTI_BLK = 0xFC,
 	SD_STOP_TRANS = 0xFD,
 	SD_VERIFY_TYPE = 0x01,
-	SD_WRITE_BLK = 0x05
+	SD_WRITE_BLK = 0x05,
+	SD_WRITE_CRC_ERR = 0x0B
 };
 
+/* Times a block the card rejects for a bad CRC is sent again */
+enum { SD_CRC_RETRIES = 3 };
+
+/* Times a write the card stays busy on past the timeout is stopped and sent again */
+enum { SD_TIMEOUT_RETRIES = 3 };
+
 enum { SD_WRITE_BLK_MASK = 0x1F };
 
 /* FAT Constants */
@@ -77,11 +92,85 @@ enum {
 	MAX_FILE_NAME = 5 /* Maximum length of file name (+3 chars for file num) */
 };
 
+/* FAT16 cluster values (too large for a 16 bit enum) */
+#define FAT_BAD_CLUST	0xFFF7	/* Bad cluster */
+#define FAT_EOC			0xFFF8	/* End of cluster chain (0xFFF8 - 0xFFFF) */
+
 enum FATErrCodes {
 	FAT_SUCCESS = 0,
 	FAT_DT_FULL,
 	FAT_BAD_BOOT_SECT,
-	FAT_BAD_SECT_SIZE
+	FAT_BAD_SECT_SIZE,
+	FAT_SCRATCH_FULL,
+	FAT_NO_FILE,
+	FAT_DISK_FULL
+};
+
+/* Maximum number of orphaned cluster chains recovered per mount */
+enum { MAX_ORPHANS = 8 };
+
+/*
+ * Number of FAT and directory table sectors cached: the FAT sector new
+ * clusters are linked in and the directory table sector of the open file, so
+ * a checkpoint writes both back without reading either
+ */
+enum { CACHE_SLOTS = 2 };
+
+/* Marks an empty cache slot (sector 0 never holds FAT or directory entries) */
+enum { CACHE_EMPTY = 0 };
+
+struct sectorcache {	/* Write-back cache of FAT and directory table sectors */
+	uint8_t data[CACHE_SLOTS][BLKSIZE];
+	uint32_t offset[CACHE_SLOTS];	/* Offset of the sector in each slot */
+	uint8_t dirty[CACHE_SLOTS];		/* Slot has changed since it was read */
+	uint16_t used[CACHE_SLOTS];		/* When each slot was last used */
+	uint16_t clock;					/* Incremented on each use */
+	uint32_t hits;					/* Sectors found in the cache */
+	uint32_t misses;				/* Sectors read from the SD card */
+};
+
+/* Background write states */
+enum SDWriteState {
+	SD_WRITE_IDLE = 0,
+	SD_WRITE_ISSUE,		/* Waiting for the card before sending the write command */
+	SD_WRITE_TRANSFER,	/* Sending the next block */
+	SD_WRITE_BUSY,		/* Card is programming the last block sent */
+	SD_WRITE_STOP,		/* Card is finishing after the 'Stop Tran' token */
+	SD_WRITE_RESTART,	/* Card is programming the last block sent before the write is stopped and sent again */
+	SD_WRITE_DONE		/* Finished, result not yet collected */
+};
+
+/*
+ * Write latency histogram: bucket k counts writes that took under
+ * 2^(SD_LATENCY_SHIFT + k) timer ticks and the last bucket counts the rest
+ */
+enum {
+	SD_LATENCY_BUCKETS = 10,
+	SD_LATENCY_SHIFT = 14
+};
+
+/* Timer values passed to the writer wrap at 24 bits */
+#define SD_TIME_MASK	0xFFFFFFUL
+
+struct sdfile;
+
+struct sdwriter {	/* Multiple block write advanced a step at a time */
+	uint8_t state;					/* enum SDWriteState */
+	uint8_t err;					/* Result of the finished write */
+	uint8_t *data;					/* Blocks to write */
+	uint32_t offset;				/* Offset of the first block on the SD card */
+	uint8_t blocks;					/* Number of blocks in the write */
+	uint8_t sent;					/* Number of blocks sent so far */
+	uint8_t retries;				/* Times the current block was sent again */
+	uint8_t restarts;				/* Times the write was sent again after a timeout */
+	struct sdfile *owner;			/* File the write belongs to */
+	uint32_t start;					/* Time the write was started */
+	uint32_t restart;				/* Time the write was started or last sent again */
+	uint32_t timeout;				/* Ticks before a write is stopped and sent again */
+	uint32_t (*get_time)(void);		/* Timer value (24 bits) */
+	uint16_t latency[SD_LATENCY_BUCKETS];	/* Write latency histogram */
+	uint16_t timeouts;				/* Writes stopped after the timeout */
+	uint16_t crc_retries;			/* Blocks sent again after a bad CRC */
 };
 
 struct fatstruct {	/* FAT information based on boot sector */
@@ -100,22 +189,135 @@ struct fatstruct {	/* FAT information based on boot sector */
 	uint32_t nhidsects;				/* Number of hidden sectors */
 	/* Offset of the boot record sector, determined by number of hidden sectors */
 	uint32_t bootoffset;
+	uint32_t freecursor;			/* FAT byte index to resume the free cluster search */
+	struct sectorcache cache;		/* Metadata sectors (shared by all open files) */
+	struct sdwriter writer;			/* File data write in progress (shared by all open files) */
+};
+
+/* Size of the leading fields of a fatstruct that are read from the boot sector */
+#define FAT_GEOMETRY_SIZE	offsetof(struct fatstruct, freecursor)
+
+/* Marks an unknown or missing entry offset in a dirindex */
+enum { DIR_INDEX_NONE = 0 };
+
+struct dirindex {	/* Directory table index, built in a single pass at mount */
+	uint16_t next_file_num;			/* Next usable file number suffix */
+	uint32_t free_entry;			/* Offset of the next empty entry */
+	uint32_t deleted_entry;			/* Offset to resume searching for deleted entries */
+	uint32_t config_entry;			/* Offset of the CONFIG.INI entry */
+	uint16_t config_cluster;		/* Starting cluster of CONFIG.INI */
+	uint32_t config_size;			/* Size of CONFIG.INI in bytes */
+	uint16_t config_time;			/* Last modified time of CONFIG.INI */
+	uint16_t config_date;			/* Last modified date of CONFIG.INI */
+};
+
+struct sdfile {	/* A file that is appended to through its own buffer */
+	struct fatstruct *info;
+	struct dirindex *dir;
+	uint8_t name[MAX_FILE_NAME + 1];	/* File name prefix (file number is appended) */
+	uint8_t ext[3];					/* File name extension */
+	uint8_t *buffer;				/* Data buffer */
+	uint16_t buffer_size;			/* Multiple of BLKSIZE that divides the cluster size */
+	uint16_t index;					/* Buffer position of the next byte */
+	uint16_t head;					/* Buffer position of the oldest unwritten block */
+	uint8_t queued;					/* Full blocks from head waiting to be written */
+	uint8_t batch;					/* Full blocks gathered before starting a write */
+	uint16_t start_cluster;			/* First cluster */
+	uint16_t cluster;				/* Current cluster */
+	uint8_t block_num;				/* Current block in current cluster */
+	uint32_t size;					/* Bytes written to the SD card */
+	uint32_t entry_offset;			/* Offset of the directory table entry */
+	uint16_t file_num;				/* File name number suffix */
+	uint16_t unsynced_clusters;		/* Clusters taken since the last sync */
+	uint8_t ring;					/* Reclaim the oldest data when the card is full */
+	uint16_t reserved_end;			/* Cluster after a burst file's run (0: not a burst file) */
 };
 
 uint8_t init_sd(void);
+
+/*
+ * Check with SEND_STATUS that a card initialized earlier (and kept powered) is
+ * still ready, so it doesn't need init_sd() again
+ */
+uint8_t status_sd(void);
 void go_idle_sd(void);
 uint8_t send_cmd_sd(SDcmd cmd, uint32_t arg);
 uint8_t send_acmd_sd(SDcmd acmd, uint32_t arg);
 uint8_t write_multiple_block(uint8_t *data, uint32_t start_offset, uint8_t blocks);
 uint8_t write_block(uint8_t *data, uint32_t offset, uint16_t count);
 uint8_t read_block(uint8_t *data, uint32_t offset, enum SDTimeout timeout);
-uint16_t find_cluster(uint8_t *data, struct fatstruct *info);
+uint8_t read_multiple_block_start(uint32_t start_offset);
+uint8_t read_multiple_block_next(uint8_t *data, enum SDTimeout timeout);
+void read_multiple_block_stop(void);
+
+/*
+ * Set up the background writer. get_time returns a timer value that wraps at
+ * 24 bits and timeout is in its ticks.
+ */
+void construct_writer(struct sdwriter *writer, uint32_t (*get_time)(void), uint32_t timeout);
+
+/*
+ * Start a multiple block write of blocks from data at start_offset for owner.
+ * The writer must be idle. The card stays selected until the write is done.
+ */
+void start_write(struct sdwriter *writer, struct sdfile *owner, uint8_t *data, uint32_t start_offset, uint8_t blocks);
+
+/*
+ * Advance the write by one step without waiting on the card and return the
+ * new state. A write that takes longer than the timeout is stopped with a
+ * 'Stop Tran' token and sent again from the first block the card hasn't
+ * accepted. After SD_TIMEOUT_RETRIES of those it ends in SD_WRITE_DONE with
+ * SD_TIMEOUT, with the card out of the write.
+ */
+uint8_t step_write(struct sdwriter *writer);
+
+/*
+ * Step the write until the card is free (SD_WRITE_IDLE or SD_WRITE_DONE).
+ */
+void finish_write(struct sdwriter *writer);
+
+/*
+ * Time the given number of multiple block writes of blocks each from data at
+ * consecutive offsets from start_offset. The mean and worst write are in the
+ * writer's timer ticks. The region is overwritten, so it must be scratch space
+ * such as an empty file's first cluster.
+ */
+uint8_t probe_write_speed(struct fatstruct *info, uint8_t *data, uint32_t start_offset, uint8_t blocks, uint8_t writes, uint32_t *mean_ticks, uint32_t *worst_ticks);
+uint8_t cache_sector(struct fatstruct *info, uint32_t offset, uint8_t **sector);
+void mark_sector_dirty(struct fatstruct *info, const uint8_t *sector);
+uint8_t flush_cache(struct fatstruct *info);
+void invalidate_cache(struct fatstruct *info);
+uint16_t find_cluster(struct fatstruct *info);
 uint32_t get_cluster_offset(uint16_t clust, struct fatstruct *info);
 uint8_t valid_block(uint8_t block, struct fatstruct *info);
-uint8_t update_fat(uint8_t *data, struct fatstruct *info, uint16_t index, uint16_t num);
-uint8_t update_dir_table(uint8_t *data, struct fatstruct *info, uint16_t cluster, uint32_t file_size, uint8_t *file_name, uint16_t file_num);
+uint8_t update_fat(struct fatstruct *info, uint32_t index, uint16_t num);
+uint8_t read_fat(struct fatstruct *info, uint16_t cluster, uint16_t *next);
+uint8_t free_cluster_chain(struct fatstruct *info, uint16_t cluster);
+
+/*
+ * Find the first run of count consecutive free clusters without claiming it.
+ * Return FAT_DISK_FULL if there is none.
+ */
+uint8_t find_cluster_run(struct fatstruct *info, uint16_t count, uint16_t *start);
+
+/*
+ * Chain the clusters from first to last in the cached FAT
+ */
+uint8_t link_cluster_run(struct fatstruct *info, uint16_t first, uint16_t last);
+uint8_t delete_oldest_file(struct fatstruct *info, struct dirindex *index, const uint8_t *file_name, uint32_t exclude_offset);
 uint8_t valid_boot_sector(uint8_t *data, struct fatstruct *boot);
 uint8_t parse_boot_sector(uint8_t *data, struct fatstruct *info);
+
+/*
+ * Copy the FAT_GEOMETRY_SIZE bytes parsed from the boot sector to geometry
+ */
+void save_fat_geometry(const struct fatstruct *info, uint8_t *geometry);
+
+/*
+ * Use geometry saved from an earlier parse_boot_sector() of the same card
+ * instead of parsing the boot sector again
+ */
+void load_fat_geometry(struct fatstruct *info, const uint8_t *geometry);
 void delete_file(uint8_t, uint32_t, uint8_t *data, struct fatstruct *info);
 
 /* For writing a good boot sector; taken from an SD card with a working boot sector */
@@ -123,9 +325,111 @@ void fat_defaults(struct fatstruct *info);
 void format_sd(uint8_t *data, struct fatstruct *info, void (*pre_format)(), void (*during_format)(), void (*post_format)());
 
 /*
- * Scan through directory table for highest file number suffix and return the
- * next highest number.
+ * Read the directory table once and fill the index with the next file number
+ * suffix for file_name, the next empty and deleted entries and the CONFIG.INI
+ * entry.
+ */
+uint8_t build_dir_index(uint8_t *data, struct fatstruct *info, const uint8_t *file_name, struct dirindex *index);
+
+/*
+ * Return true iff the CONFIG.INI entry recorded in index is still on the card
+ * with the same starting cluster, size and last modified date and time. Only
+ * the entry's block is read, so no FAT information is needed.
+ */
+uint8_t same_config_entry(uint8_t *data, const struct dirindex *index);
+
+/*
+ * Claim the next directory table entry from the index and return its offset.
+ * Return FAT_DT_FULL if the directory table is full.
+ */
+uint8_t claim_dir_entry(struct fatstruct *info, struct dirindex *index, uint32_t *entry_offset);
+
+/*
+ * Claim the next directory table entry from the index and return its offset
+ * and file number. Return FAT_DT_FULL if the directory table is full.
+ */
+uint8_t reserve_dir_entry(struct fatstruct *info, struct dirindex *index, uint32_t *entry_offset, uint16_t *file_num);
+
+/*
+ * Write a directory table entry at entry_offset in the cached sector holding
+ * it. It reaches the card with the next flush_cache().
+ */
+uint8_t write_dir_entry(struct fatstruct *info, uint32_t entry_offset, const uint8_t *file_name, const uint8_t *ext, uint16_t file_num, uint16_t cluster, uint32_t file_size);
+
+/*
+ * Set up a file handle (closed) that writes through the provided buffer. Each
+ * write starts as soon as a block is full unless batch is raised.
+ *
+ * name: file name prefix, up to MAX_FILE_NAME characters
+ * ext: 3 character file name extension
+ * buffer_size: a multiple of BLKSIZE that divides the cluster size
+ */
+void construct_file(struct sdfile *file, struct fatstruct *info, struct dirindex *dir, const uint8_t *name, const uint8_t *ext, uint8_t *buffer, uint16_t buffer_size);
+
+/*
+ * Create a new file for appending: claim a cluster and a directory table
+ * entry and write the entry with an empty size. A file_num of 0 takes the next
+ * file number from the directory table index.
+ */
+uint8_t open_file(struct sdfile *file, uint16_t file_num);
+
+/*
+ * Create a burst file in a run of the given number of consecutive clusters. Nothing is
+ * written to the FAT or the directory table until the file is closed, so
+ * appending to it never waits on metadata. The file must be closed before the
+ * run is full, and it is lost if logging is cut off.
+ */
+uint8_t open_burst_file(struct sdfile *file, uint16_t clusters);
+
+/*
+ * Append a byte to the file. Each full block of the buffer is queued for the
+ * background writer, and this only waits on the card when every block of the
+ * buffer is queued. The FAT entries for new clusters go to the metadata cache
+ * with those of the other open files and are written back when a file is
+ * synced.
+ */
+uint8_t append_file(struct sdfile *file, uint8_t value);
+
+/*
+ * Advance the background write, whichever file it belongs to, and start
+ * writing the file's queued blocks when the writer is free. Call this often
+ * while the file is open.
+ */
+uint8_t step_file(struct sdfile *file);
+
+/*
+ * Number of bytes appended to the file, including those not yet written to the
+ * SD card.
+ */
+uint32_t file_length(const struct sdfile *file);
+
+/*
+ * Write the file's size to its directory table entry and write back the cached
+ * FAT and directory table sectors. A write in progress is finished first.
+ */
+uint8_t sync_file(struct sdfile *file);
+
+/*
+ * Write all of the file's full blocks, however few are queued, and wait for
+ * the card. The bytes after the last full block stay in the buffer.
+ */
+uint8_t drain_file(struct sdfile *file);
+
+/*
+ * Wait for the queued blocks, write the rest of the buffer and sync the file.
+ * A burst file's chain is written up to its last cluster with data. The file can't be appended
+ * to after this.
+ */
+uint8_t close_file(struct sdfile *file);
+
+/*
+ * Find cluster chains in the FAT that no directory table entry points to and
+ * give each one a new directory table entry (file_name + next file number)
+ * with a size inferred from its length and the data in its last cluster.
+ *
+ * scratch: working memory for the directory table's starting clusters and the
+ * FAT's non-consecutive links (2 bytes each)
  */
-uint16_t get_file_num(uint8_t *data, const struct fatstruct *info, const uint8_t *file_name);
+uint8_t recover_orphans(uint8_t *data, struct fatstruct *info, struct dirindex *index, const uint8_t *file_name, uint8_t *scratch, uint16_t scratch_size);
 
 #endif
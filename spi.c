@@ -69,6 +69,24 @@ uint8_t spia_rec(void) {
 	return (UCA1RXBUF);
 }
 
+/*----------------------------------------------------------------------------*/
+/* Run USCI_A1 SPI at SMCLK (only once the SD card is initialized)			  */
+/*----------------------------------------------------------------------------*/
+void spia_fast(void) {
+	UCA1CTL1 |= UCSWRST;			// Hold in reset
+	UCA1BR0 = 1;					// Clock = SMCLK
+	UCA1CTL1 &= ~UCSWRST;			// Release from reset
+}
+
+/*----------------------------------------------------------------------------*/
+/* Run USCI_A1 SPI at SMCLK / 3												  */
+/*----------------------------------------------------------------------------*/
+void spia_normal(void) {
+	UCA1CTL1 |= UCSWRST;			// Hold in reset
+	UCA1BR0 = 3;					// Clock = SMCLK / 3
+	UCA1CTL1 &= ~UCSWRST;			// Release from reset
+}
+
 /*----------------------------------------------------------------------------*/
 /* Transmit byte to USCI_B1 SPI slave and return received byte				  */
 /*----------------------------------------------------------------------------*/
@@ -8,6 +8,8 @@
 void spi_config(void);
 uint8_t spia_send(uint8_t b);
 uint8_t spia_rec(void);
+void spia_fast(void);
+void spia_normal(void);
 uint8_t spib_send(uint8_t b);
 uint8_t spib_rec(void);
 